@@ -6,217 +6,540 @@
 #include <netdb.h>
 #include <sys/types.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <sys/socket.h>
+#include <sys/time.h>
 #include <fcntl.h>
 #include <arpa/inet.h>
+#include <time.h>
 
 #include "config.h"
 
-int
-main(void)
+/* Maximum number of addresses raced in one connection round */
+#define MAX_CANDIDATES 64
+
+/* The heartbeat sent to the server */
+#define HEARTBEAT "!\n"
+#define HEARTBEAT_LEN 2
+
+/*
+ * now_ms()
+ *
+ * Return the current time of the monotonic clock in milliseconds
+ */
+static long long
+now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+ * sleep_ms(ms)
+ *
+ * Sleep for the given number of milliseconds
+ */
+static void
+sleep_ms(long long ms)
+{
+    struct timespec ts;
+
+    ts.tv_sec = ms / 1000;
+    ts.tv_nsec = (ms % 1000) * 1000000;
+
+    while ((nanosleep(&ts, &ts) < 0) && (errno == EINTR));
+}
+
+/*
+ * resolve(server, result)
+ *
+ * Resolve a server given as host, host:port, a bare IPv6 address or
+ * [ipv6]:port. Returns 0 on success, or the getaddrinfo() error code.
+ */
+static int
+resolve(const char *server, struct addrinfo **result)
 {
-    int sockfd;
     struct addrinfo hints;
-    struct addrinfo *servinfo;
-    struct addrinfo *p;
-    int rv;
-    int connected;
+    char host[256];
+    const char *port = PORT;
+    char *colon;
 
     // Set the hints
     memset(&hints, 0, sizeof hints);
     hints.ai_family = AF_UNSPEC;
     hints.ai_socktype = SOCK_STREAM;
 
+    snprintf(host, sizeof host, "%s", server);
+
+    if (host[0] == '[') {
+        // Strip the brackets around IPv6 addresses. The port is after
+        // the closing bracket, if given
+        char *bracket = strchr(host, ']');
+
+        if ((bracket == NULL)
+            || ((bracket[1] != 0) && (bracket[1] != ':'))) {
+            return EAI_NONAME;
+        }
+
+        if (bracket[1] == ':') {
+            port = bracket + 2;
+        }
+        *bracket = 0;
+        memmove(host, host + 1, strlen(host));
+    }
+    // Otherwise a single colon separates the port. More colons mean a
+    // bare IPv6 address
+    else if (((colon = strchr(host, ':')) != NULL)
+             && (strchr(colon + 1, ':') == NULL)) {
+        *colon = 0;
+        port = colon + 1;
+    }
+
     // Get address info (AKA resolv hostname)
-    if ((rv = getaddrinfo(SERVER_ADDRESS, PORT, &hints, &servinfo)) != 0) {
-        fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(rv));
-        return 1;
+    return getaddrinfo(host, port, &hints, result);
+}
+
+/*
+ * sort_candidates(servinfo, server_count, candidates)
+ *
+ * Collect the addresses of all the servers into candidates, in the
+ * order they should be tried. As RFC 8305 suggests, address families
+ * are interleaved (starting with IPv6), so a broken IPv6 (or IPv4)
+ * path delays the connection by one attempt only. Returns the number
+ * of candidates.
+ */
+static int
+sort_candidates(struct addrinfo **servinfo, int server_count,
+                struct addrinfo **candidates)
+{
+    struct addrinfo *v6[MAX_CANDIDATES];
+    struct addrinfo *v4[MAX_CANDIDATES];
+    struct addrinfo *p;
+    int v6_count = 0;
+    int v4_count = 0;
+    int count = 0;
+    int i;
+
+    for (i = 0; i < server_count; i++) {
+        for (p = servinfo[i]; p != NULL; p = p->ai_next) {
+            if ((p->ai_family == AF_INET6) && (v6_count < MAX_CANDIDATES)) {
+                v6[v6_count++] = p;
+            } else if ((p->ai_family != AF_INET6)
+                       && (v4_count < MAX_CANDIDATES)) {
+                v4[v4_count++] = p;
+            }
+        }
     }
 
-    // Cycle OUTER
-    while (1) {
-        int con;
+    for (i = 0; (i < v6_count) || (i < v4_count); i++) {
+        if ((i < v6_count) && (count < MAX_CANDIDATES)) {
+            candidates[count++] = v6[i];
+        }
 
-        // Here we assume that we are not connected.
-        connected = 0;
+        if ((i < v4_count) && (count < MAX_CANDIDATES)) {
+            candidates[count++] = v4[i];
+        }
+    }
 
-        printf("Connecting...\n");
+    return count;
+}
+
+/*
+ * start_connect(sockfd, p, fastopen, sent)
+ *
+ * Start a non-blocking connection. If fastopen is set, and the kernel
+ * has a TCP Fast Open cookie for the server, the first heartbeat is
+ * sent in the SYN packet, and sent is set. Returns the result of
+ * connect().
+ */
+static int
+start_connect(int sockfd, struct addrinfo *p, int fastopen, int *sent)
+{
+    *sent = 0;
+
+#ifdef USE_TCP_FASTOPEN
+    if (fastopen) {
+        ssize_t len;
+
+        len = sendto(sockfd, HEARTBEAT, HEARTBEAT_LEN,
+                     MSG_FASTOPEN | MSG_NOSIGNAL,
+                     p->ai_addr, p->ai_addrlen);
+
+        if (len >= 0) {
+            // The data went out in the SYN, the handshake is still
+            // in progress
+            *sent = (len == HEARTBEAT_LEN);
+            errno = EINPROGRESS;
+
+            return -1;
+        }
+
+        // Without a cookie only the SYN is sent (with a cookie
+        // request), and EINPROGRESS is returned. If Fast Open is
+        // disabled, fall back to a plain connect()
+        if (errno != EOPNOTSUPP) {
+            return -1;
+        }
+    }
+#endif
+
+    return connect(sockfd, p->ai_addr, p->ai_addrlen);
+}
+
+/*
+ * connect_race(candidates, count, sent)
+ *
+ * Connect to the first candidate that answers. A new connection
+ * attempt is started every CONNECTION_ATTEMPT_DELAY milliseconds (or
+ * right away when an attempt fails) while the previous ones are still
+ * in progress. Only the first attempt of a round uses TCP Fast Open,
+ * so a fallback losing the race doesn't deliver a heartbeat (thus an
+ * allow and a block) to its server. Returns the connected
+ * (non-blocking) socket, or -1 if all the attempts failed or timed
+ * out. sent is set if the first heartbeat was already sent.
+ */
+static int
+connect_race(struct addrinfo **candidates, int count, int *sent)
+{
+    int fds[MAX_CANDIDATES];
+    int fds_sent[MAX_CANDIDATES];
+    int next = 0;
+    int active = 0;
+    int winner = -1;
+    long long next_start = now_ms();
+    long long deadline = 0;
+    int i;
+
+    for (i = 0; i < count; i++) {
+        fds[i] = -1;
+    }
+
+    while (winner < 0) {
+        long long now = now_ms();
+        long long wait;
+        struct timeval tv;
+        fd_set write_fds;
+        int fdmax = -1;
+        int t;
+
+        // Start the next attempt if it's time for it, or if there
+        // are no attempts in progress
+        if ((next < count) && ((active == 0) || (now >= next_start))) {
+            struct addrinfo *p = candidates[next];
+            int sockfd;
 
-        // Create a socket
-        for (p = servinfo; p != NULL; p = p->ai_next) {
             if ((sockfd = socket(p->ai_family,
                                  p->ai_socktype,
                                  p->ai_protocol)) == -1) {
                 perror("client: socket");
+                next++;
 
                 continue;
             }
 
+            // Set the socket to non-blocking so we can race it with
+            // the others
+            fcntl(sockfd, F_SETFL, O_NONBLOCK);
+
+            // Start the connection (it usually won't succeed yet)
+            if (start_connect(sockfd, p, next == 0, &fds_sent[next]) == 0) {
+                // We are now connected. Usually we won't get here,
+                // but in the select() loop below instead
+                fds[next++] = sockfd;
+                winner = next - 1;
+
+                break;
+            } else if (errno == EINPROGRESS) {
+                fds[next++] = sockfd;
+                active++;
+
+                // Only an attempt in progress delays the next one. A
+                // failed one (e.g. ENETUNREACH without an IPv6 route)
+                // is followed by the next candidate right away
+                next_start = now + CONNECTION_ATTEMPT_DELAY;
+                deadline = now + CONNECT_TIMEOUT;
+            } else {
+                perror("client: connect");
+                close(sockfd);
+                next++;
+            }
+
+            continue;
+        }
+
+        // Nothing is in progress, and there is nothing left to try
+        if (active == 0) {
             break;
         }
 
-        // If p is NULL, we didn't succeed to create a socket. This
-        // should never happen
-        if (p == NULL) {
-            fprintf(stderr, "client: failed to connect\n");
-
-            return 2;
-        }
-
-        // Set the socket to non-blocking so we can control the timeout value
-        fcntl(sockfd, F_SETFL, O_NONBLOCK);
-
-        // Start the connection (it usually won't succeed yet)
-        con = connect(sockfd, p->ai_addr, p->ai_addrlen);
-
-        // If connect() returned an error saying the connection is in progress
-        if ((con < 0) && (errno == EINPROGRESS)) {
-            // Cycle INNER1
-            while (1) {
-                struct timeval tv;
-                int t;
-                fd_set master;
-
-                // Create an empty descriptor set, and add our socket to it
-                FD_ZERO(&master);
-                FD_SET(sockfd, &master);
-
-                // Set the timeout value to SENDING_FREQ seconds
-                tv.tv_sec = SENDING_FREQ;
-                tv.tv_usec = 0;
-
-                // Run the select()
-                t = select(sockfd + 1, NULL, &master, NULL, &tv);
-
-                if ((t < 0) && (errno != EINTR)) {
-                    // Some serious error happened, let's exit
-                    perror("select");
-
-                    exit(1);
-                } else if (t < 0) {
-                    // select() was interrupted, lets restart the INNER1 cycle
-                    printf("select() interrupted, continue\n");
-
-                    continue;
-                } else if (t > 0) {
-                    size_t lon;
-                    int valopt;
-
-                    lon = sizeof(int);
-                    if (getsockopt(sockfd,
-                                   SOL_SOCKET, SO_ERROR,
-                                   (void*)(&valopt), &lon) < 0) {
-                        fprintf(stderr,
-                                "Error in getsockopt() %d - %s\n",
-                                errno, strerror(errno));
-                        connected = 0;
-                        sleep(SENDING_FREQ);
-
-                        break;
-                    }
-                    // Check the value returned...
-                    if (valopt) {
-                        fprintf(stderr,
-                                "Error in delayed connection() %d - %s\n",
-                                valopt, strerror(valopt));
-                        connected = 0;
-                        sleep(SENDING_FREQ);
-
-                        break;
-                    }
-
-                    printf("Connected with select().\n");
-                    connected = 1;
-
-                    break;
-                } else if (t == 0) {
-                    // Connection timed out, let's break out from INNER1
-                    printf("connect() timed out.\n");
-                    connected = 0;
-                    close(sockfd);
-
-                    break;
+        // Wait until the next attempt is due, or until the last
+        // attempt times out
+        wait = ((next < count) ? next_start : deadline) - now;
+        if (wait <= 0) {
+            if (next < count) {
+                continue;
+            }
+
+            printf("connect() timed out.\n");
+
+            break;
+        }
+
+        // Create a descriptor set of the attempts in progress
+        FD_ZERO(&write_fds);
+        for (i = 0; i < next; i++) {
+            if (fds[i] >= 0) {
+                FD_SET(fds[i], &write_fds);
+                if (fds[i] > fdmax) {
+                    fdmax = fds[i];
                 }
             }
-        } else if (con < 0) {
-            // connect() error. Wait SENDING_FREQ seconds and try
-            // again (restarting the OUTER cycle)
+        }
 
-            // XXX error handling?
-            printf("connect() error, retry\n");
-            sleep(SENDING_FREQ);
-            connected = 0;
+        tv.tv_sec = wait / 1000;
+        tv.tv_usec = (wait % 1000) * 1000;
+
+        // Run the select()
+        t = select(fdmax + 1, NULL, &write_fds, NULL, &tv);
 
+        if ((t < 0) && (errno != EINTR)) {
+            // Some serious error happened, let's exit
+            perror("select");
+
+            exit(1);
+        } else if (t <= 0) {
+            // Interrupted, or it's time to start the next attempt
             continue;
-        } else if (con == 0) {
-            // We are now connected. Usually we won't get here, but in
-            // the select() loop above instead
-            printf("Connected without select().\n");
-            connected = 1;
-        }
-
-        if (connected) {
-            // If we are connected, let's jump in the INNER2 cycle
-            while (1) {
-                fd_set read_fds;
-                int t;
-                struct timeval tv;
-                char buf[MAXDATASIZE];
-
-                // Create and empty descriptor set and add our socket
-                FD_ZERO(&read_fds);
-                FD_SET(sockfd, &read_fds);
-
-                // Set the timeout value to SENDING_FREQ seconds
-                tv.tv_sec = SENDING_FREQ;
-                tv.tv_usec = 0;
-
-                // Let's run the select()
-                t = select(sockfd + 1, &read_fds, NULL, NULL, &tv);
-
-                if ((t < 0) && (errno != EINTR)) {
-                    // select() ran into an error, this is bad. Let's exit
-                    perror("select");
-
-                    exit(1);
-                } else if (t < 0) {
-                    // select() interrupted, try again by restarting
-                    // the INNER2 cycle
-                    printf("select() interrupted\n");
-
-                    continue;
-                } else if (t > 0) {
-                    // We got some data from the server
-                    size_t len;
-
-                    printf("Data from server.\n");
-
-                    len = recv(sockfd, &buf, MAXDATASIZE, 0);
-
-                    if (len <= 0) {
-                        // If the received data length is at most 0,
-                        // we are disconnected, so break out from
-                        // INNER2
-                        printf("Closing connection.\n");
-                        connected = 0;
-                        close(sockfd);
-
-                        break;
-                    }
-                }
+        }
+
+        for (i = 0; i < next; i++) {
+            socklen_t lon;
+            int valopt;
 
-                // If we arrive here, select() ran into timeout, so we
-                // should send some data to the server.
-                printf("Sending data to server\n");
-                send(sockfd, "!\n", 2, 0);
+            if ((fds[i] < 0) || !FD_ISSET(fds[i], &write_fds)) {
+                continue;
+            }
+
+            lon = sizeof(int);
+            if (getsockopt(fds[i],
+                           SOL_SOCKET, SO_ERROR,
+                           (void*)(&valopt), &lon) < 0) {
+                valopt = errno;
+            }
+
+            if (valopt == 0) {
+                printf("Connected with select().\n");
+                winner = i;
+
+                break;
+            }
+
+            // This attempt failed, so start the next one right away
+            fprintf(stderr,
+                    "Error in delayed connection() %d - %s\n",
+                    valopt, strerror(valopt));
+            close(fds[i]);
+            fds[i] = -1;
+            active--;
+            next_start = now;
+        }
+    }
+
+    // Close the losing attempts
+    for (i = 0; i < next; i++) {
+        if ((i != winner) && (fds[i] >= 0)) {
+            close(fds[i]);
+        }
+    }
+
+    if (winner < 0) {
+        return -1;
+    }
+
+    *sent = fds_sent[winner];
+
+    return fds[winner];
+}
+
+/*
+ * backoff_delay(delay)
+ *
+ * Return a randomized delay between half and the full value of delay,
+ * so clients losing their connection at the same time don't all come
+ * back at the same time
+ */
+static long long
+backoff_delay(long long delay)
+{
+    return delay / 2 + random() % (delay / 2 + 1);
+}
+
+/*
+ * session(sockfd, sent)
+ *
+ * Keep sending data to the server over the connected socket, until
+ * the connection is lost. The first heartbeat is sent right away
+ * (unless sent is set, meaning it already went out with TCP Fast
+ * Open), as the server only gets the connection when data arrives.
+ */
+static void
+session(int sockfd, int sent)
+{
+    if (!sent && (send(sockfd, HEARTBEAT, HEARTBEAT_LEN, MSG_NOSIGNAL) < 0)) {
+        perror("send");
+        close(sockfd);
+
+        return;
+    }
+
+    // INNER2 cycle
+    while (1) {
+        fd_set read_fds;
+        int t;
+        struct timeval tv;
+        char buf[MAXDATASIZE];
+
+        // Create and empty descriptor set and add our socket
+        FD_ZERO(&read_fds);
+        FD_SET(sockfd, &read_fds);
+
+        // Set the timeout value to SENDING_FREQ seconds
+        tv.tv_sec = SENDING_FREQ;
+        tv.tv_usec = 0;
+
+        // Let's run the select()
+        t = select(sockfd + 1, &read_fds, NULL, NULL, &tv);
+
+        if ((t < 0) && (errno != EINTR)) {
+            // select() ran into an error, this is bad. Let's exit
+            perror("select");
+
+            exit(1);
+        } else if (t < 0) {
+            // select() interrupted, try again by restarting
+            // the INNER2 cycle
+            printf("select() interrupted\n");
+
+            continue;
+        } else if (t > 0) {
+            // We got some data from the server
+            ssize_t len;
+
+            printf("Data from server.\n");
+
+            len = recv(sockfd, &buf, MAXDATASIZE, 0);
+
+            if (len <= 0) {
+                // If the received data length is at most 0, we are
+                // disconnected, so break out from INNER2
+                printf("Closing connection.\n");
+                close(sockfd);
+
+                return;
             }
         }
+
+        // If we arrive here, select() ran into timeout, so we
+        // should send some data to the server. MSG_NOSIGNAL keeps
+        // a dropped connection from killing us with SIGPIPE
+        printf("Sending data to server\n");
+        if (send(sockfd, HEARTBEAT, HEARTBEAT_LEN, MSG_NOSIGNAL) < 0) {
+            perror("send");
+            close(sockfd);
+
+            return;
+        }
+    }
+}
+
+int
+main(int argc, char **argv)
+{
+    const char *default_servers[] = SERVER_ADDRESSES;
+    const char **servers = default_servers;
+    int server_count = sizeof default_servers / sizeof default_servers[0];
+    struct addrinfo *servinfo[MAX_SERVERS];
+    struct addrinfo *candidates[MAX_CANDIDATES];
+    int resolved = 0;
+    long long delay = RECONNECT_MIN_DELAY;
+    int i;
+
+    // Servers given on the command line override the configured ones
+    if (argc > 1) {
+        servers = (const char **)argv + 1;
+        server_count = argc - 1;
     }
 
-    // This should never happen, but if so, let's clean up after ourselved
-    freeaddrinfo(servinfo);
+    if (server_count > MAX_SERVERS) {
+        fprintf(stderr, "Too many servers, using the first %d\n",
+                MAX_SERVERS);
+        server_count = MAX_SERVERS;
+    }
+
+    srandom(time(NULL) ^ getpid());
+
+    // Cycle OUTER
+    while (1) {
+        int count;
+        int sockfd;
+        int sent;
+
+        // (Re)resolve the servers if the last round couldn't connect
+        // to any of them. The addresses may have changed
+        if (!resolved) {
+            for (i = 0; i < server_count; i++) {
+                int rv;
+
+                if ((rv = resolve(servers[i], &servinfo[i])) != 0) {
+                    fprintf(stderr, "getaddrinfo: %s: %s\n",
+                            servers[i], gai_strerror(rv));
+                    servinfo[i] = NULL;
+                }
+            }
 
-    close(sockfd);
+            resolved = 1;
+        }
+
+        count = sort_candidates(servinfo, server_count, candidates);
+
+        printf("Connecting...\n");
+
+        if ((count > 0) && ((sockfd = connect_race(candidates, count, &sent)) >= 0)) {
+            long long started = now_ms();
+
+            session(sockfd, sent);
+
+            // If the connection was up for a while, this is a new
+            // failure, so reconnect after the shortest delay. Otherwise
+            // the server keeps dropping us, so keep backing off
+            if (now_ms() - started >= SENDING_FREQ * 1000) {
+                delay = RECONNECT_MIN_DELAY;
+            }
+        } else {
+            // All the attempts failed, so resolve again before the
+            // next round
+            for (i = 0; i < server_count; i++) {
+                if (servinfo[i]) {
+                    freeaddrinfo(servinfo[i]);
+                }
+            }
+            resolved = 0;
+
+            printf("connect() error, retry\n");
+        }
+
+        // Wait a bit before trying again, with exponentially growing
+        // delays
+        sleep_ms(backoff_delay(delay));
+
+        delay *= 2;
+        if (delay > RECONNECT_MAX_DELAY) {
+            delay = RECONNECT_MAX_DELAY;
+        }
+    }
 
     return 0;
 }
@@ -1,4 +1,28 @@
 #define PORT "2884"
 #define MAXDATASIZE 128
 #define SENDING_FREQ 10
-#define SERVER_ADDRESS "127.0.0.1"
+
+// The servers to connect to, in order of preference. Servers may be
+// given as host, host:port or [ipv6]:port. These can be overridden on
+// the command line
+#define SERVER_ADDRESSES { "127.0.0.1" }
+
+// Maximum number of servers
+#define MAX_SERVERS 8
+
+// Milliseconds to wait before racing the next address while the
+// previous connection attempts are still in progress (RFC 8305
+// recommends 250)
+#define CONNECTION_ATTEMPT_DELAY 250
+
+// Give up on a connection attempt after this many milliseconds
+#define CONNECT_TIMEOUT (SENDING_FREQ * 1000)
+
+// Delay (in milliseconds) before the first reconnection attempt. It
+// is doubled after every failure, up to RECONNECT_MAX_DELAY
+#define RECONNECT_MIN_DELAY 50
+#define RECONNECT_MAX_DELAY 5000
+
+// Send the first heartbeat in the SYN packet with TCP Fast Open, if
+// the kernel allows it. Comment out to disable
+#define USE_TCP_FASTOPEN
@@ -20,3 +20,66 @@
 
 // Number of concurrent incoming (non-accepted) connections
 #define BACKLOG 10
+
+// Maximum number of simultaneously connected clients. Client records
+// are preallocated for this many clients at startup. The -n option
+// overrides it, up to FD_SETSIZE
+#define CLIENT_POOL_SIZE 1024
+
+// Path of the local administrative control socket
+#define CONTROL_SOCKET "auth.sock"
+
+// Maximum number of simultaneous control socket connections
+#define CONTROL_MAX_CONNECTIONS 16
+
+// Maximum number of bytes queued for one control connection. Slow
+// event subscribers exceeding this get disconnected
+#define CONTROL_MAX_QUEUE (1024 * 1024)
+
+// Directory of the binary audit journal
+#define JOURNAL_DIR "journal"
+
+// Number of journal records written in one batch
+#define JOURNAL_BATCH 256
+
+// Write the buffered journal records at least this often (in seconds)
+#define JOURNAL_FLUSH_INTERVAL 1
+
+// Start a new journal segment after this many records
+#define JOURNAL_SEGMENT_RECORDS (1024 * 1024)
+
+// Number of connect/disconnect scripts whose exit status is tracked
+// for the journal at the same time
+#define MAX_RUNNING_SCRIPTS 256
+
+// Refuse the clients of a revoked IP for this many seconds
+#define REVOKE_DENY_TIME 300
+
+// Maximum number of revoked IPs refused at the same time
+#define REVOKE_MAX_DENIED 256
+
+// Maximum number of replication peers (see the -R and -P options)
+#define REPLICATION_MAX_PEERS 8
+
+// Maximum number of IPs replicated from the peers
+#define REPLICATION_MAX_REPLICAS 4096
+
+// Send the full client list to the peers this often (in seconds)
+#define REPLICATION_SYNC_INTERVAL 2
+
+// Keep replicated IPs allowed for this many seconds more than their
+// origin does, so a client failing over finds its IP still allowed
+#define REPLICATION_GRACE 10
+
+// Accept TCP Fast Open connections, so a knock's first data can
+// arrive in the SYN packet. On Linux this also needs the 2 bit of the
+// net.ipv4.tcp_fastopen sysctl (e.g. set it to 3). Comment out to
+// disable
+#define USE_TCP_FASTOPEN
+
+// Number of pending TCP Fast Open requests
+#define TCP_FASTOPEN_QUEUE BACKLOG
+
+// Don't wake up for a new connection until it sends data, or this
+// many seconds pass (TCP_DEFER_ACCEPT). Comment out to disable
+#define DEFER_ACCEPT_TIMEOUT 5
@@ -0,0 +1,592 @@
+/* Define this to get accept4() */
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <time.h>
+#include <stdarg.h>
+
+#include "config.h"
+#include "server.h"
+#include "core.h"
+#include "control.h"
+#include "journal.h"
+#include "replication.h"
+
+/* Maximum length of one command line, including the newline */
+#define CONTROL_LINE_LEN 128
+
+/* The control_conn_t struct. It holds the state of one connection on
+ * the control socket. Replies and events are queued in out, and sent
+ * whenever the socket becomes writable, so a slow reader never blocks
+ * the event loop. A connection marked closing is closed right away,
+ * one marked draining is closed once its queued output is sent */
+typedef struct _control_conn_t {
+    int socket;
+    int subscribed;
+    int closing;
+    int draining;
+    char in[CONTROL_LINE_LEN];
+    size_t in_len;
+    char *out;
+    size_t out_len;
+    size_t out_size;
+} control_conn_t;
+
+/* The listening control socket */
+static int control_listen = -1;
+/* The control connections. Unused slots have a socket of -1 */
+static control_conn_t control_conns[CONTROL_MAX_CONNECTIONS];
+
+/* Names of the event types, indexed by CONTROL_EVENT_* */
+static const char *control_event_names[] = {
+    "CONNECT",
+    "DISCONNECT",
+    "TIMEOUT",
+};
+
+/*
+ * control_init(path)
+ *
+ * Create the listening Unix domain control socket at path. A stale
+ * socket file left over from a previous run is removed first. Returns
+ * the listening socket, or -1 on failure (with errno set).
+ */
+int
+control_init(const char *path)
+{
+    struct sockaddr_un addr;
+    mode_t old_umask;
+    int rv;
+    int i;
+
+    // Mark all connection slots as unused
+    for (i = 0; i < CONTROL_MAX_CONNECTIONS; i++) {
+        control_conns[i].socket = -1;
+        control_conns[i].out = NULL;
+    }
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof addr);
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    if ((control_listen = socket(AF_UNIX,
+                                 SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                                 0)) == -1) {
+        return -1;
+    }
+
+    // Remove the stale socket file, if any
+    unlink(path);
+
+    // Only the owner (usually root) may control the server. The
+    // socket file is created with these permissions, so there is no
+    // window in which others could connect
+    old_umask = umask(S_IRWXG | S_IRWXO);
+    rv = bind(control_listen, (struct sockaddr *)&addr, sizeof addr);
+    umask(old_umask);
+
+    if (rv == -1) {
+        close(control_listen);
+        control_listen = -1;
+
+        return -1;
+    }
+
+    if (listen(control_listen, CONTROL_MAX_CONNECTIONS) == -1) {
+        close(control_listen);
+        control_listen = -1;
+
+        return -1;
+    }
+
+    return control_listen;
+}
+
+/*
+ * control_close(conn)
+ *
+ * Close a control connection and free its slot
+ */
+static void
+control_close(control_conn_t *conn)
+{
+    close(conn->socket);
+    free(conn->out);
+
+    conn->socket = -1;
+    conn->out = NULL;
+    conn->out_len = 0;
+    conn->out_size = 0;
+}
+
+/*
+ * control_flush(conn)
+ *
+ * Send as much of the queued output as the socket accepts without
+ * blocking
+ */
+static void
+control_flush(control_conn_t *conn)
+{
+    ssize_t sent;
+
+    if ((conn->out_len == 0) || conn->closing) {
+        return;
+    }
+
+    sent = send(conn->socket, conn->out, conn->out_len,
+                MSG_DONTWAIT | MSG_NOSIGNAL);
+
+    if (sent < 0) {
+        // A full socket buffer is not an error, we will try again
+        // when select() says it is writable
+        if ((errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR)) {
+            conn->closing = 1;
+        }
+
+        return;
+    }
+
+    // Move the unsent part to the beginning of the buffer
+    memmove(conn->out, conn->out + sent, conn->out_len - sent);
+    conn->out_len -= sent;
+}
+
+/*
+ * control_queue(conn, format, ...)
+ *
+ * Append a formatted line to the connection's output queue. If the
+ * queue would grow beyond CONTROL_MAX_QUEUE, the connection is marked
+ * for closing instead.
+ */
+static void
+control_queue(control_conn_t *conn, const char *format, ...)
+{
+    va_list ap;
+    char line[CONTROL_LINE_LEN];
+    int len;
+
+    // Nothing more is sent after a QUIT
+    if (conn->closing || conn->draining) {
+        return;
+    }
+
+    va_start(ap, format);
+    len = vsnprintf(line, sizeof line, format, ap);
+    va_end(ap);
+
+    if (len < 0) {
+        return;
+    }
+
+    // Truncated lines still end with a newline
+    if (len >= (int)sizeof line) {
+        len = sizeof line - 1;
+        line[len - 1] = '\n';
+    }
+
+    if (conn->out_len + len > CONTROL_MAX_QUEUE) {
+        log_message(LOG_LEVEL_ERROR,
+                    "Control connection %d is too slow, dropping",
+                    conn->socket);
+        conn->closing = 1;
+
+        return;
+    }
+
+    // Grow the buffer by doubling its size
+    if (conn->out_len + len > conn->out_size) {
+        size_t new_size;
+        char *new_out;
+
+        new_size = conn->out_size ? conn->out_size : 4096;
+        while (new_size < conn->out_len + len) {
+            new_size *= 2;
+        }
+
+        if ((new_out = realloc(conn->out, new_size)) == NULL) {
+            log_message(LOG_LEVEL_ERROR, "realloc: %s", strerror(errno));
+            conn->closing = 1;
+
+            return;
+        }
+
+        conn->out = new_out;
+        conn->out_size = new_size;
+    }
+
+    memcpy(conn->out + conn->out_len, line, len);
+    conn->out_len += len;
+}
+
+/*
+ * control_queue_client(conn, client)
+ *
+ * Queue one CLIENT record about the given client
+ */
+static void
+control_queue_client(control_conn_t *conn, client_t *client)
+{
+    control_queue(conn, "CLIENT %d %s %ld %ld\n",
+                  client->socket, client->ip,
+                  (long)client->last_reset, (long)client->deadline);
+}
+
+/*
+ * control_command(conn, line)
+ *
+ * Execute one command line received on a control connection.
+ * Supported commands are:
+ *
+ *   LIST                  list all the connected clients
+ *   QUERY <ip>            list the clients connected from <ip>
+ *   REVOKE <ip>           disconnect (and block) all clients of <ip>, and
+ *                         refuse them for REVOKE_DENY_TIME seconds
+ *   EXTEND <ip> <seconds> push the deadline of <ip>'s clients forward
+ *   REPLICAS              list the IPs allowed by the replication peers
+ *   SUBSCRIBE             stream connect, disconnect and timeout events
+ *   QUIT                  close the control connection
+ *
+ * Every command is answered with "OK <count>" or "ERR <reason>".
+ */
+static void
+control_command(control_conn_t *conn, char *line)
+{
+    char *saveptr;
+    char *command;
+    char *ip;
+    char *arg;
+    client_t *temp;
+    int count = 0;
+
+    if ((command = strtok_r(line, " \t\r", &saveptr)) == NULL) {
+        return;
+    }
+
+    ip = strtok_r(NULL, " \t\r", &saveptr);
+    arg = strtok_r(NULL, " \t\r", &saveptr);
+
+    if (strcmp(command, "LIST") == 0) {
+        for (temp = client_list; temp; temp = temp->next) {
+            control_queue_client(conn, temp);
+            count++;
+        }
+    } else if (strcmp(command, "QUERY") == 0) {
+        if (ip == NULL) {
+            control_queue(conn, "ERR missing ip\n");
+
+            return;
+        }
+
+        for (temp = client_list; temp; temp = temp->next) {
+            if (strcmp(temp->ip, ip) == 0) {
+                control_queue_client(conn, temp);
+                count++;
+            }
+        }
+    } else if (strcmp(command, "REVOKE") == 0) {
+        if (ip == NULL) {
+            control_queue(conn, "ERR missing ip\n");
+
+            return;
+        }
+
+        log_message(LOG_LEVEL_INFO, "Control: revoking IP %s", ip);
+        journal_event(JOURNAL_EVENT_REVOKE, ip, -1, JOURNAL_NO_RESULT);
+
+        // Forget the IP's replicas, and have the peers refuse it too,
+        // then disconnect (and refuse) its local clients. The
+        // firewall is blocked once the last holder is gone
+        replication_deny(ip, REVOKE_DENY_TIME);
+        count = client_revoke(ip, REVOKE_DENY_TIME);
+    } else if (strcmp(command, "EXTEND") == 0) {
+        char *end;
+        long seconds;
+        time_t now;
+
+        if ((ip == NULL) || (arg == NULL)) {
+            control_queue(conn, "ERR usage: EXTEND <ip> <seconds>\n");
+
+            return;
+        }
+
+        seconds = strtol(arg, &end, 10);
+        if ((*end != 0) || (seconds <= 0)) {
+            control_queue(conn, "ERR invalid seconds\n");
+
+            return;
+        }
+
+        log_message(LOG_LEVEL_INFO,
+                    "Control: extending IP %s by %ld seconds",
+                    ip, seconds);
+
+        now = time(NULL);
+        for (temp = client_list; temp; temp = temp->next) {
+            if (strcmp(temp->ip, ip) == 0) {
+                // Extend from now if the deadline is already in the
+                // past (the client is about to time out)
+                if (temp->deadline < now) {
+                    temp->deadline = now;
+                }
+                temp->deadline += seconds;
+                control_queue_client(conn, temp);
+                // Let the peers know about the new deadline
+                replication_event(REPLICATION_OP_ALLOW, temp);
+                count++;
+            }
+        }
+    } else if (strcmp(command, "REPLICAS") == 0) {
+        replica_t *replicas;
+        int replica_count;
+        int i;
+
+        replicas = replication_replicas(&replica_count);
+        for (i = 0; i < replica_count; i++) {
+            if (replicas[i].in_use) {
+                control_queue(conn, "REPLICA %s %ld %08x\n",
+                              replicas[i].ip_str, (long)replicas[i].deadline,
+                              replicas[i].sender);
+                count++;
+            }
+        }
+    } else if (strcmp(command, "SUBSCRIBE") == 0) {
+        conn->subscribed = 1;
+    } else if (strcmp(command, "QUIT") == 0) {
+        // Close after the replies to the previous commands are sent
+        conn->draining = 1;
+
+        return;
+    } else {
+        control_queue(conn, "ERR unknown command\n");
+
+        return;
+    }
+
+    control_queue(conn, "OK %d\n", count);
+}
+
+/*
+ * control_read(conn)
+ *
+ * Read the available data from a control connection, and execute all
+ * the complete command lines
+ */
+static void
+control_read(control_conn_t *conn)
+{
+    ssize_t read_len;
+    char *newline;
+
+    read_len = recv(conn->socket, conn->in + conn->in_len,
+                    CONTROL_LINE_LEN - conn->in_len, 0);
+
+    if (read_len < 0) {
+        if ((errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR)) {
+            conn->closing = 1;
+        }
+
+        return;
+    } else if (read_len == 0) {
+        conn->closing = 1;
+
+        return;
+    }
+
+    conn->in_len += read_len;
+
+    // Execute every complete line in the buffer, up to a QUIT
+    while (!conn->draining
+           && ((newline = memchr(conn->in, '\n', conn->in_len)) != NULL)) {
+        size_t line_len = newline - conn->in + 1;
+
+        *newline = 0;
+        control_command(conn, conn->in);
+
+        memmove(conn->in, conn->in + line_len, conn->in_len - line_len);
+        conn->in_len -= line_len;
+    }
+
+    // A full buffer without a newline is an overlong command
+    if (!conn->draining && (conn->in_len == CONTROL_LINE_LEN)) {
+        control_queue(conn, "ERR line too long\n");
+        conn->draining = 1;
+    }
+}
+
+/*
+ * control_fd_set(read_fds, write_fds)
+ *
+ * Close the connections marked for closing (and the draining ones
+ * with nothing left to send), then add the control sockets to the
+ * descriptor sets passed to select(). Connections with queued output
+ * are added to write_fds, draining connections aren't read any more.
+ * Returns the highest socket number added.
+ */
+int
+control_fd_set(fd_set *read_fds, fd_set *write_fds)
+{
+    int i;
+    int max = control_listen;
+
+    if (control_listen < 0) {
+        return -1;
+    }
+
+    FD_SET(control_listen, read_fds);
+
+    for (i = 0; i < CONTROL_MAX_CONNECTIONS; i++) {
+        control_conn_t *conn = &control_conns[i];
+
+        if (conn->socket < 0) {
+            continue;
+        }
+
+        if (conn->closing || (conn->draining && (conn->out_len == 0))) {
+            control_close(conn);
+
+            continue;
+        }
+
+        if (!conn->draining) {
+            FD_SET(conn->socket, read_fds);
+        }
+        if (conn->out_len > 0) {
+            FD_SET(conn->socket, write_fds);
+        }
+
+        if (conn->socket > max) {
+            max = conn->socket;
+        }
+    }
+
+    return max;
+}
+
+/*
+ * control_handle(read_fds, write_fds)
+ *
+ * Accept new control connections, send queued output and execute
+ * incoming commands. The control sockets are removed from the
+ * descriptor sets, so the caller only sees its own sockets.
+ */
+void
+control_handle(fd_set *read_fds, fd_set *write_fds)
+{
+    int i;
+
+    if (control_listen < 0) {
+        return;
+    }
+
+    if (FD_ISSET(control_listen, read_fds)) {
+        int new_socket;
+
+        FD_CLR(control_listen, read_fds);
+
+        new_socket = accept4(control_listen, NULL, NULL,
+                             SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+        if (new_socket >= 0) {
+            // Find a free slot for the new connection
+            for (i = 0; i < CONTROL_MAX_CONNECTIONS; i++) {
+                if (control_conns[i].socket < 0) {
+                    break;
+                }
+            }
+
+            if (i == CONTROL_MAX_CONNECTIONS) {
+                log_message(LOG_LEVEL_ERROR,
+                            "Too many control connections, refusing");
+                close(new_socket);
+            } else if (new_socket >= FD_SETSIZE) {
+                log_message(LOG_LEVEL_ERROR,
+                            "Control connection %d above FD_SETSIZE",
+                            new_socket);
+                close(new_socket);
+            } else {
+                control_conn_t *conn = &control_conns[i];
+
+                conn->socket = new_socket;
+                conn->subscribed = 0;
+                conn->closing = 0;
+                conn->draining = 0;
+                conn->in_len = 0;
+                conn->out = NULL;
+                conn->out_len = 0;
+                conn->out_size = 0;
+            }
+        }
+    }
+
+    for (i = 0; i < CONTROL_MAX_CONNECTIONS; i++) {
+        control_conn_t *conn = &control_conns[i];
+        int readable;
+        int writable;
+
+        if (conn->socket < 0) {
+            continue;
+        }
+
+        readable = FD_ISSET(conn->socket, read_fds);
+        writable = FD_ISSET(conn->socket, write_fds);
+        FD_CLR(conn->socket, read_fds);
+        FD_CLR(conn->socket, write_fds);
+
+        if (readable && !conn->closing && !conn->draining) {
+            control_read(conn);
+        }
+
+        // Replies are sent right away if the socket has room for
+        // them, the rest waits for the next writable notification
+        if (readable || writable) {
+            control_flush(conn);
+        }
+    }
+}
+
+/*
+ * control_event(type, client)
+ *
+ * Send an event record about client to all the subscribed control
+ * connections. The record looks like
+ *
+ *   EVENT <type> <timestamp> <socket> <ip> <deadline>
+ */
+void
+control_event(int type, client_t *client)
+{
+    int i;
+    time_t now = 0;
+
+    for (i = 0; i < CONTROL_MAX_CONNECTIONS; i++) {
+        control_conn_t *conn = &control_conns[i];
+
+        if ((conn->socket < 0) || !conn->subscribed) {
+            continue;
+        }
+
+        if (now == 0) {
+            now = time(NULL);
+        }
+
+        control_queue(conn, "EVENT %s %ld %d %s %ld\n",
+                      control_event_names[type], (long)now,
+                      client->socket, client->ip, (long)client->deadline);
+        control_flush(conn);
+    }
+}
@@ -0,0 +1,18 @@
+#ifndef _AUTH_CONTROL_H
+# define _AUTH_CONTROL_H
+
+#include <sys/select.h>
+
+#include "server.h"
+
+/* Event types sent to the control socket subscribers */
+#define CONTROL_EVENT_CONNECT 0
+#define CONTROL_EVENT_DISCONNECT 1
+#define CONTROL_EVENT_TIMEOUT 2
+
+int control_init(const char *path);
+int control_fd_set(fd_set *read_fds, fd_set *write_fds);
+void control_handle(fd_set *read_fds, fd_set *write_fds);
+void control_event(int type, client_t *client);
+
+#endif /* _AUTH_CONTROL_H */
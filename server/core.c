@@ -0,0 +1,413 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "config.h"
+#include "server.h"
+#include "core.h"
+
+/* This will point to the beginning of the client list */
+client_t *client_list;
+/* This will point to the end of the client list, so new clients can
+ * be appended without walking it */
+static client_t *client_tail;
+/* The clients indexed by their socket numbers, socket_limit long */
+static client_t **client_by_socket;
+static int socket_limit;
+/* The slab holding all the client records, pool_size long */
+static client_t *client_pool;
+static int pool_size;
+/* This will point to the first unused slot in client_pool */
+static client_t *client_free_list;
+/* The outside world */
+static const core_ops_t *core_ops;
+/* The revoked IPs. Slots at or above denied_high are all unused */
+static denied_t denied[REVOKE_MAX_DENIED];
+static int denied_high;
+
+/*
+ * client_pool_init()
+ *
+ * Allocate the slab holding all the client records, and chain every
+ * slot into the free list. This is the only place where client
+ * memory is allocated, so connecting and disconnecting clients never
+ * calls malloc() or free(). Returns 0 on success, -1 on failure.
+ */
+static int
+client_pool_init(void)
+{
+    int i;
+
+    // Allocate all the client records in one contiguous block, and
+    // the socket index
+    client_pool = calloc(pool_size, sizeof(client_t));
+    client_by_socket = calloc(socket_limit, sizeof(client_t *));
+    if ((client_pool == NULL) || (client_by_socket == NULL)) {
+        return -1;
+    }
+
+    // Chain all the slots together, the last one terminates the list
+    for (i = 0; i < pool_size - 1; i++) {
+        client_pool[i].next = &client_pool[i + 1];
+    }
+    client_pool[pool_size - 1].next = NULL;
+
+    // Initially every slot is free
+    client_free_list = client_pool;
+
+    return 0;
+}
+
+/*
+ * client_alloc()
+ *
+ * Take a slot from the client pool's free list. Returns NULL if all
+ * the slots are in use.
+ */
+static client_t *
+client_alloc(void)
+{
+    client_t *client_data;
+
+    // If the free list is empty, there are no slots left
+    if ((client_data = client_free_list) == NULL) {
+        return NULL;
+    }
+
+    // Unlink the first slot from the free list
+    client_free_list = client_data->next;
+
+    return client_data;
+}
+
+/*
+ * client_release(client)
+ *
+ * Put a client record back to the client pool's free list
+ */
+static void
+client_release(client_t *client_data)
+{
+    client_data->previous = NULL;
+    client_data->next = client_free_list;
+    client_free_list = client_data;
+}
+
+/*
+ * core_init(ops, clients, sockets)
+ *
+ * Initialize the core with the given outside world functions, and
+ * preallocate the records of the given number of clients. Socket
+ * numbers must be below sockets. Returns 0 on success, -1 on
+ * failure.
+ */
+int
+core_init(const core_ops_t *ops, int clients, int sockets)
+{
+    core_ops = ops;
+    pool_size = clients;
+    socket_limit = sockets;
+
+    // Initially set the client list to empty
+    client_list = NULL;
+    client_tail = NULL;
+    denied_high = 0;
+
+    return client_pool_init();
+}
+
+/*
+ * client_new(socket, ip)
+ *
+ * Create a new client structure with the given data, and fully reset
+ * timer. Returns 0 on success, or -1 if the client pool is full (in
+ * which case the caller should close the socket).
+ */
+int
+client_new(int socket, const char *ip)
+{
+    client_t *client_data;
+
+    // The socket can't be indexed
+    if ((socket < 0) || (socket >= socket_limit)) {
+        log_message(LOG_LEVEL_ERROR,
+                    "Socket number %d out of range, refusing connection",
+                    socket);
+
+        return -1;
+    }
+
+    // Refuse the clients of revoked IPs
+    if (client_denied(ip)) {
+        log_message(LOG_LEVEL_INFO,
+                    "Refusing connection %d of revoked IP %s", socket, ip);
+
+        return -1;
+    }
+
+    // Get a free slot for the new client's data
+    client_data = client_alloc();
+    if (client_data == NULL) {
+        // Log an error message if the pool is exhausted. This is
+        // not fatal, we simply refuse this client
+        log_message(LOG_LEVEL_ERROR,
+                    "Client pool full (%d clients), refusing connection %d",
+                    pool_size, socket);
+
+        return -1;
+    }
+
+    // Zero-fill the address location, so the string will be surely
+    // nul-terminated
+    memset(client_data->ip, 0, CLIENT_IP_LEN);
+    strncpy(client_data->ip, ip, CLIENT_IP_LEN - 1);
+
+    // Log the connection
+    log_message(LOG_LEVEL_INFO,
+                "New connection: %d (IP: %s)",
+                socket, client_data->ip);
+
+    // Fill the client_data struct
+    client_data->socket = socket;
+    client_data->last_reset = core_ops->now();
+    client_data->deadline = client_data->last_reset + DROP_AFTER;
+    client_data->previous = NULL;
+    client_data->next = NULL;
+
+    // If the client list is empty (this is the first client)
+    if (!client_tail) {
+        // The client_list should point to the newly allocated struct
+        client_list = client_data;
+    }
+    // Otherwise (this is not the first client)
+    else {
+        // Set the last element's next pointer to point to the newly
+        // allocated struct, and its previous pointer to the (till
+        // here) last client's struct
+        client_tail->next = client_data;
+        client_data->previous = client_tail;
+    }
+    client_tail = client_data;
+
+    // Index the client by its socket
+    client_by_socket[socket] = client_data;
+
+    // Notify the outside world (control socket, journal, peers)
+    core_ops->event(CORE_EVENT_CONNECT, client_data);
+
+    // Allow the client's IP (execute the connect script)
+    core_ops->allow(client_data);
+
+    return 0;
+}
+
+/*
+ * client_remove(socket)
+ *
+ * Remove a client identified by its local socket number
+ */
+void
+client_remove(int socket)
+{
+    client_t *temp;
+
+    // Look up the client by its socket. If it's not there, we simply
+    // return. However, this should never happen
+    if ((socket < 0) || (socket >= socket_limit)
+        || ((temp = client_by_socket[socket]) == NULL)) {
+        return;
+    }
+
+    // Logging a message about the disconnection
+    log_message(LOG_LEVEL_INFO,
+                "Connection lost: %d (IP: %s)",
+                temp->socket, temp->ip);
+
+    // Remove this client from the linked list. If this is the first
+    // (or the last) client, the list's head (or tail) moves to its
+    // neighbour, or becomes NULL if it was the only client
+    if (temp->previous) {
+        temp->previous->next = temp->next;
+    } else {
+        client_list = temp->next;
+    }
+
+    if (temp->next) {
+        temp->next->previous = temp->previous;
+    } else {
+        client_tail = temp->previous;
+    }
+
+    client_by_socket[socket] = NULL;
+
+    // Notify the outside world (control socket, journal, peers)
+    core_ops->event(CORE_EVENT_DISCONNECT, temp);
+
+    // Block the client's IP (execute the disconnect script)
+    core_ops->block(temp);
+
+    // Give the struct back to the client pool
+    client_release(temp);
+
+    // Close the socket itself, and stop watching it
+    core_ops->close(socket);
+}
+
+/*
+ * client_reset_timer(socket)
+ *
+ * Reset a client's timer, identified by the local socket number
+ */
+void
+client_reset_timer(int socket)
+{
+    client_t *temp;
+
+    // Look up the client by its socket
+    if ((socket < 0) || (socket >= socket_limit)
+        || ((temp = client_by_socket[socket]) == NULL)) {
+        return;
+    }
+
+    // Set its last reset time to the current timestamp
+    temp->last_reset = core_ops->now();
+
+    // Push the deadline forward, unless it was already extended
+    // further through the control socket
+    if (temp->deadline < temp->last_reset + DROP_AFTER) {
+        temp->deadline = temp->last_reset + DROP_AFTER;
+    }
+}
+
+/*
+ * check_timers()
+ *
+ * Check all clients if they have sent data in the near past, and
+ * disconnect (thus, deauthenticate) them if not
+ */
+void
+check_timers(void)
+{
+    client_t *temp;
+    client_t *next;
+    time_t now;
+
+    now = core_ops->now();
+
+    // Walk through the client list. The next pointer is saved first,
+    // as client_remove() puts the current element back to the pool
+    for (temp = client_list; temp; temp = next) {
+        next = temp->next;
+
+        // If this client hasn't sent data in DROP_AFTER seconds (or
+        // after its extended deadline)
+        if (now > temp->deadline) {
+            // Log the timeout event
+            log_message(LOG_LEVEL_INFO,
+                        "Client timeout, dropping connection %d (IP: %s).",
+                        temp->socket, temp->ip);
+            // Notify the outside world
+            core_ops->event(CORE_EVENT_TIMEOUT, temp);
+            // And remove the client from the client list
+            client_remove(temp->socket);
+        }
+    }
+}
+
+/*
+ * client_revoke(ip, seconds)
+ *
+ * Remove all the clients of ip, and refuse its new clients for the
+ * given number of seconds. If the table of revoked IPs is full, the
+ * one expiring first is replaced. Returns the number of removed
+ * clients.
+ */
+int
+client_revoke(const char *ip, time_t seconds)
+{
+    client_t *temp;
+    client_t *next;
+    denied_t *slot = NULL;
+    time_t now;
+    int count = 0;
+    int i;
+
+    now = core_ops->now();
+
+    // Find the IP's slot, or the one expiring first
+    for (i = 0; i < REVOKE_MAX_DENIED; i++) {
+        if ((i >= denied_high) || (strcmp(denied[i].ip, ip) == 0)) {
+            slot = &denied[i];
+
+            break;
+        }
+
+        if ((slot == NULL) || (denied[i].until < slot->until)) {
+            slot = &denied[i];
+        }
+    }
+
+    if (slot - denied >= denied_high) {
+        denied_high = slot - denied + 1;
+    }
+
+    // A revoke can only make the refusal longer
+    if ((strcmp(slot->ip, ip) != 0) || (slot->until < now + seconds)) {
+        memset(slot->ip, 0, CLIENT_IP_LEN);
+        strncpy(slot->ip, ip, CLIENT_IP_LEN - 1);
+        slot->until = now + seconds;
+    }
+
+    // client_remove() releases the record, so save next first
+    for (temp = client_list; temp; temp = next) {
+        next = temp->next;
+
+        if (strcmp(temp->ip, ip) == 0) {
+            client_remove(temp->socket);
+            count++;
+        }
+    }
+
+    return count;
+}
+
+/*
+ * client_denied(ip)
+ *
+ * Check if the clients of ip are refused because it was revoked
+ */
+int
+client_denied(const char *ip)
+{
+    time_t now;
+    int i;
+
+    if (denied_high == 0) {
+        return 0;
+    }
+
+    now = core_ops->now();
+
+    for (i = 0; i < denied_high; i++) {
+        if ((denied[i].until >= now) && (strcmp(denied[i].ip, ip) == 0)) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * client_denials(count)
+ *
+ * Return the table of revoked IPs. Only the first count slots may be
+ * in use, and only those whose until is not in the past.
+ */
+denied_t *
+client_denials(int *count)
+{
+    *count = denied_high;
+
+    return denied;
+}
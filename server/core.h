@@ -0,0 +1,54 @@
+#ifndef _AUTH_CORE_H
+# define _AUTH_CORE_H
+
+#include <time.h>
+
+#include "server.h"
+
+/* The core is the client state machine: it keeps the client table,
+ * and decides when clients get allowed, timed out and blocked. It
+ * doesn't touch sockets, the clock or the firewall directly, but
+ * calls the core_ops_t functions given to core_init(). The server
+ * drives it from its select() loop, and the simulator (sim.c) from
+ * synthetic events in virtual time. */
+
+/* Event types passed to core_ops_t.event() */
+#define CORE_EVENT_CONNECT 0
+#define CORE_EVENT_DISCONNECT 1
+#define CORE_EVENT_TIMEOUT 2
+
+/* The core_ops_t struct. These functions connect the core to the
+ * outside world */
+typedef struct _core_ops_t {
+    /* Return the current time */
+    time_t (*now)(void);
+    /* Notify about a client event (before the client is removed) */
+    void (*event)(int type, client_t *client);
+    /* Allow the client's IP through the firewall */
+    void (*allow)(client_t *client);
+    /* Block the client's IP on the firewall */
+    void (*block)(client_t *client);
+    /* Close a client's socket */
+    void (*close)(int socket);
+} core_ops_t;
+
+/* The denied_t struct. It holds a revoked IP, whose clients are
+ * refused until the given time */
+typedef struct _denied_t {
+    char ip[CLIENT_IP_LEN];
+    time_t until;
+} denied_t;
+
+/* The client list. This is defined in core.c */
+extern client_t *client_list;
+
+int core_init(const core_ops_t *ops, int clients, int sockets);
+int client_new(int socket, const char *ip);
+void client_remove(int socket);
+void client_reset_timer(int socket);
+void check_timers(void);
+int client_revoke(const char *ip, time_t seconds);
+int client_denied(const char *ip);
+denied_t *client_denials(int *count);
+
+#endif /* _AUTH_CORE_H */
@@ -0,0 +1,147 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "config.h"
+#include "server.h"
+#include "firewall.h"
+#include "journal.h"
+
+/* Number of hash buckets, must be a power of two */
+#define FIREWALL_BUCKETS 4096
+
+/* The firewall_entry_t struct. It holds one allowed IP. Entries of
+ * the same bucket (and the unused ones) are chained through next */
+typedef struct _firewall_entry_t {
+    char ip[CLIENT_IP_LEN];
+    int holders;
+    struct _firewall_entry_t *next;
+} firewall_entry_t;
+
+/* The hash buckets */
+static firewall_entry_t *firewall_buckets[FIREWALL_BUCKETS];
+/* All the entries, and the unused ones */
+static firewall_entry_t *firewall_entries;
+static firewall_entry_t *firewall_free_list;
+
+/*
+ * firewall_init(max_ips)
+ *
+ * Preallocate an empty firewall table for max_ips allowed IPs.
+ * Returns 0 on success, -1 on failure.
+ */
+int
+firewall_init(int max_ips)
+{
+    int i;
+
+    memset(firewall_buckets, 0, sizeof firewall_buckets);
+
+    if ((firewall_entries = calloc(max_ips,
+                                   sizeof(firewall_entry_t))) == NULL) {
+        return -1;
+    }
+
+    for (i = 0; i < max_ips - 1; i++) {
+        firewall_entries[i].next = &firewall_entries[i + 1];
+    }
+    firewall_entries[max_ips - 1].next = NULL;
+
+    firewall_free_list = firewall_entries;
+
+    return 0;
+}
+
+/*
+ * firewall_bucket(ip)
+ *
+ * Return the hash bucket of ip (FNV-1a)
+ */
+static firewall_entry_t **
+firewall_bucket(const char *ip)
+{
+    unsigned int hash = 2166136261u;
+
+    while (*ip) {
+        hash = (hash ^ (unsigned char)*ip++) * 16777619u;
+    }
+
+    return &firewall_buckets[hash & (FIREWALL_BUCKETS - 1)];
+}
+
+/*
+ * firewall_hold(ip, socket)
+ *
+ * Add a holder to ip. The connect script is executed if this is the
+ * first one. socket is the holder client's socket (or -1 for
+ * replicas), it only goes to the journal.
+ */
+void
+firewall_hold(const char *ip, int socket)
+{
+    firewall_entry_t **bucket = firewall_bucket(ip);
+    firewall_entry_t *entry;
+
+    for (entry = *bucket; entry; entry = entry->next) {
+        if (strcmp(entry->ip, ip) == 0) {
+            entry->holders++;
+
+            return;
+        }
+    }
+
+    // This is the first holder, so the IP gets an entry
+    if ((entry = firewall_free_list) == NULL) {
+        // This should never happen, see firewall_init()
+        log_message(LOG_LEVEL_ERROR,
+                    "Firewall table full, not allowing IP %s", ip);
+
+        return;
+    }
+    firewall_free_list = entry->next;
+
+    memset(entry->ip, 0, CLIENT_IP_LEN);
+    strncpy(entry->ip, ip, CLIENT_IP_LEN - 1);
+    entry->holders = 1;
+    entry->next = *bucket;
+    *bucket = entry;
+
+    execute_script(CLIENT_CONNECT_SCRIPT, JOURNAL_EVENT_SCRIPT_ALLOW,
+                   ip, socket);
+}
+
+/*
+ * firewall_release(ip, socket)
+ *
+ * Remove a holder from ip. The disconnect script is executed if this
+ * was the last one.
+ */
+void
+firewall_release(const char *ip, int socket)
+{
+    firewall_entry_t **link;
+    firewall_entry_t *entry;
+
+    for (link = firewall_bucket(ip); (entry = *link); link = &entry->next) {
+        if (strcmp(entry->ip, ip) == 0) {
+            break;
+        }
+    }
+
+    // The IP is not held (this should never happen)
+    if (entry == NULL) {
+        return;
+    }
+
+    if (--entry->holders > 0) {
+        return;
+    }
+
+    // That was the last holder, give the entry back
+    *link = entry->next;
+    entry->next = firewall_free_list;
+    firewall_free_list = entry;
+
+    execute_script(CLIENT_DISCONNECT_SCRIPT, JOURNAL_EVENT_SCRIPT_BLOCK,
+                   ip, socket);
+}
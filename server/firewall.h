@@ -0,0 +1,15 @@
+#ifndef _AUTH_FIREWALL_H
+# define _AUTH_FIREWALL_H
+
+/* The firewall table counts the holders of every allowed IP: the
+ * local clients connected from it, and the peers replicating it. The
+ * connect script runs when an IP gets its first holder, and the
+ * disconnect script when it loses its last one, so several clients
+ * behind the same address, or a client failing over between servers,
+ * don't block each other. */
+
+int firewall_init(int max_ips);
+void firewall_hold(const char *ip, int socket);
+void firewall_release(const char *ip, int socket);
+
+#endif /* _AUTH_FIREWALL_H */
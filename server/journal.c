@@ -0,0 +1,379 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
+#include <time.h>
+
+#include "config.h"
+#include "server.h"
+#include "journal.h"
+
+/* The journal directory. It is opened once, so segments can be
+ * rotated even after daemon() changed the working directory */
+static int journal_dir_fd = -1;
+/* The current segment */
+static int journal_fd = -1;
+/* Name of the current segment file */
+static char journal_name[64];
+/* Sequence number of the next segment */
+static unsigned int journal_seq = 0;
+/* Number of records in the current segment, including the buffered
+ * ones */
+static uint32_t journal_count = 0;
+/* The IP index of the current segment, JOURNAL_SEGMENT_RECORDS long.
+ * It is filled as the records are appended, so closing a segment
+ * doesn't have to read it back */
+static journal_index_t *journal_index = NULL;
+/* Records waiting to be written */
+static journal_record_t journal_buf[JOURNAL_BATCH];
+static int journal_buf_len = 0;
+/* Time of the last flush */
+static time_t journal_last_flush = 0;
+
+static void journal_rotate(void);
+
+/*
+ * journal_write_all(fd, data, len)
+ *
+ * Write len bytes to fd, retrying on partial writes. Returns 0 on
+ * success, -1 on failure.
+ */
+static int
+journal_write_all(int fd, const void *data, size_t len)
+{
+    const char *p = data;
+
+    while (len > 0) {
+        ssize_t written = write(fd, p, len);
+
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            return -1;
+        }
+
+        p += written;
+        len -= written;
+    }
+
+    return 0;
+}
+
+/*
+ * journal_write_header(fd, magic)
+ *
+ * Write a segment or index file header
+ */
+static int
+journal_write_header(int fd, const char *magic)
+{
+    journal_header_t header;
+
+    memset(&header, 0, sizeof header);
+    strncpy(header.magic, magic, sizeof header.magic - 1);
+    header.version = JOURNAL_VERSION;
+    header.record_size = sizeof(journal_record_t);
+
+    return journal_write_all(fd, &header, sizeof header);
+}
+
+/*
+ * journal_open_segment()
+ *
+ * Create a new segment file and make it the current one
+ */
+static int
+journal_open_segment(void)
+{
+    // A previous run (restarted within the same second) may have
+    // used the name already, so try the next sequence number then
+    do {
+        snprintf(journal_name, sizeof journal_name, "%012ld-%06u.seg",
+                 (long)time(NULL), journal_seq++);
+
+        journal_fd = openat(journal_dir_fd, journal_name,
+                            O_WRONLY | O_CREAT | O_EXCL | O_APPEND
+                            | O_CLOEXEC,
+                            0640);
+    } while ((journal_fd < 0) && (errno == EEXIST));
+
+    if (journal_fd < 0) {
+        return -1;
+    }
+
+    if (journal_write_header(journal_fd, JOURNAL_SEGMENT_MAGIC) < 0) {
+        close(journal_fd);
+        journal_fd = -1;
+
+        return -1;
+    }
+
+    journal_count = 0;
+
+    return 0;
+}
+
+/*
+ * journal_index_compare(a, b)
+ *
+ * qsort() comparator ordering index entries by IP, then by record
+ * number
+ */
+static int
+journal_index_compare(const void *a, const void *b)
+{
+    const journal_index_t *ia = a;
+    const journal_index_t *ib = b;
+
+    if (ia->ip != ib->ip) {
+        return (ia->ip < ib->ip) ? -1 : 1;
+    }
+
+    if (ia->record != ib->record) {
+        return (ia->record < ib->record) ? -1 : 1;
+    }
+
+    return 0;
+}
+
+/*
+ * journal_write_index(name, index, count)
+ *
+ * Sort the IP index of the segment called name, and write it out. The
+ * index is written to a temporary file first, so readers never see a
+ * partial index. Returns 0 on success, -1 on failure.
+ */
+static int
+journal_write_index(const char *name, journal_index_t *index, uint32_t count)
+{
+    char idx_name[72];
+    char tmp_name[80];
+    int fd;
+
+    qsort(index, count, sizeof(journal_index_t),
+          journal_index_compare);
+
+    // Replace the .seg extension with .idx
+    snprintf(idx_name, sizeof idx_name, "%.*s.idx",
+             (int)(strlen(name) - 4), name);
+    snprintf(tmp_name, sizeof tmp_name, "%s.tmp", idx_name);
+
+    fd = openat(journal_dir_fd, tmp_name,
+                O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0640);
+    if ((fd < 0)
+        || (journal_write_header(fd, JOURNAL_INDEX_MAGIC) < 0)
+        || (journal_write_all(fd, index,
+                              count * sizeof(journal_index_t)) < 0)) {
+        log_message(LOG_LEVEL_ERROR, "journal index: %s", strerror(errno));
+        if (fd >= 0) {
+            close(fd);
+        }
+        unlinkat(journal_dir_fd, tmp_name, 0);
+
+        return -1;
+    }
+
+    close(fd);
+
+    if (renameat(journal_dir_fd, tmp_name, journal_dir_fd, idx_name) < 0) {
+        log_message(LOG_LEVEL_ERROR, "journal index: %s", strerror(errno));
+        unlinkat(journal_dir_fd, tmp_name, 0);
+
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * journal_init(path)
+ *
+ * Open (or create) the journal directory, and start a new segment in
+ * it. Returns 0 on success, -1 on failure (with errno set).
+ */
+int
+journal_init(const char *path)
+{
+    if ((mkdir(path, 0750) < 0) && (errno != EEXIST)) {
+        return -1;
+    }
+
+    journal_index = malloc(JOURNAL_SEGMENT_RECORDS * sizeof(journal_index_t));
+    if (journal_index == NULL) {
+        return -1;
+    }
+
+    if ((journal_dir_fd = open(path,
+                               O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0) {
+        return -1;
+    }
+
+    if (journal_open_segment() < 0) {
+        close(journal_dir_fd);
+        journal_dir_fd = -1;
+
+        return -1;
+    }
+
+    journal_last_flush = time(NULL);
+
+    return 0;
+}
+
+/*
+ * journal_flush()
+ *
+ * Write all the buffered records to the current segment in one
+ * write. If writing fails, the buffered records are lost, and the
+ * segment is truncated back to its last complete record. If even that
+ * fails, a new segment is started.
+ */
+void
+journal_flush(void)
+{
+    off_t good_len;
+
+    if ((journal_fd < 0) || (journal_buf_len == 0)) {
+        return;
+    }
+
+    // The length of the segment without the buffered records
+    good_len = sizeof(journal_header_t)
+        + (off_t)(journal_count - journal_buf_len) * sizeof(journal_record_t);
+
+    if (journal_write_all(journal_fd, journal_buf,
+                          journal_buf_len * sizeof(journal_record_t)) < 0) {
+        log_message(LOG_LEVEL_ERROR, "journal write: %s", strerror(errno));
+
+        // The lost records must not be indexed, and a partially
+        // written batch would shift every later record
+        journal_count -= journal_buf_len;
+        journal_buf_len = 0;
+
+        if (ftruncate(journal_fd, good_len) < 0) {
+            log_message(LOG_LEVEL_ERROR,
+                        "journal truncate: %s", strerror(errno));
+            journal_rotate();
+        }
+    }
+
+    journal_buf_len = 0;
+    journal_last_flush = time(NULL);
+}
+
+/*
+ * journal_rotate()
+ *
+ * Close the current segment, and start a new one. The index of the
+ * closed segment is sorted and written by a child process, so the
+ * main loop doesn't stall on it. The child gets its own copy of the
+ * index when the parent starts filling it again.
+ */
+static void
+journal_rotate(void)
+{
+    pid_t pid;
+
+    journal_flush();
+    close(journal_fd);
+
+    pid = fork();
+    if (pid == 0) {
+        _exit((journal_write_index(journal_name, journal_index,
+                                   journal_count) < 0) ? 1 : 0);
+    } else if (pid < 0) {
+        // Do it here then
+        log_message(LOG_LEVEL_ERROR, "fork: %s", strerror(errno));
+        journal_write_index(journal_name, journal_index, journal_count);
+    }
+
+    if (journal_open_segment() < 0) {
+        log_message(LOG_LEVEL_ERROR, "journal segment: %s", strerror(errno));
+    }
+}
+
+/*
+ * journal_event(type, ip, socket, result)
+ *
+ * Append a record to the journal. Records are buffered, and written
+ * in batches of JOURNAL_BATCH records, or by journal_tick().
+ */
+void
+journal_event(int type, const char *ip, int socket, int result)
+{
+    journal_record_t *record;
+    struct in_addr addr;
+
+    if (journal_fd < 0) {
+        return;
+    }
+
+    if (inet_pton(AF_INET, ip, &addr) != 1) {
+        addr.s_addr = 0;
+    }
+
+    record = &journal_buf[journal_buf_len++];
+    record->timestamp = time(NULL);
+    record->ip = addr.s_addr;
+    record->socket = socket;
+    record->type = type;
+    record->reserved = 0;
+    record->result = result;
+
+    journal_index[journal_count].ip = addr.s_addr;
+    journal_index[journal_count].record = journal_count;
+    journal_count++;
+
+    if (journal_count >= JOURNAL_SEGMENT_RECORDS) {
+        journal_rotate();
+    } else if (journal_buf_len == JOURNAL_BATCH) {
+        journal_flush();
+    }
+}
+
+/*
+ * journal_tick(now)
+ *
+ * Flush the buffered records if they are waiting for more than
+ * JOURNAL_FLUSH_INTERVAL seconds. Called from the main loop.
+ */
+void
+journal_tick(time_t now)
+{
+    if ((journal_buf_len > 0)
+        && (now - journal_last_flush >= JOURNAL_FLUSH_INTERVAL)) {
+        journal_flush();
+    }
+}
+
+/*
+ * journal_close()
+ *
+ * Flush the buffered records and close the current segment, writing
+ * its index
+ */
+void
+journal_close(void)
+{
+    if (journal_fd < 0) {
+        return;
+    }
+
+    journal_flush();
+    close(journal_fd);
+    journal_fd = -1;
+
+    // Don't leave empty segments behind
+    if (journal_count == 0) {
+        unlinkat(journal_dir_fd, journal_name, 0);
+    } else {
+        journal_write_index(journal_name, journal_index, journal_count);
+    }
+}
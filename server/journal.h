@@ -0,0 +1,69 @@
+#ifndef _AUTH_JOURNAL_H
+# define _AUTH_JOURNAL_H
+
+#include <stdint.h>
+
+#include "server.h"
+
+/* The journal is a directory of segment files. Each segment starts
+ * with a journal_header_t, followed by fixed-size journal_record_t
+ * records in the order they were written. Segment file names are
+ * <first timestamp>-<sequence>.seg, so sorting them by name sorts
+ * them by time.
+ *
+ * When a segment is closed, an index file with the same name and an
+ * .idx extension is written next to it. It holds a journal_header_t
+ * followed by journal_index_t entries sorted by IP address, then by
+ * record number. */
+
+#define JOURNAL_SEGMENT_MAGIC "FKJSEG1"
+#define JOURNAL_INDEX_MAGIC "FKJIDX1"
+#define JOURNAL_VERSION 1
+
+/* Journal event types */
+#define JOURNAL_EVENT_CONNECT 1
+#define JOURNAL_EVENT_DISCONNECT 2
+#define JOURNAL_EVENT_TIMEOUT 3
+#define JOURNAL_EVENT_REVOKE 4
+#define JOURNAL_EVENT_SCRIPT_ALLOW 5
+#define JOURNAL_EVENT_SCRIPT_BLOCK 6
+#define JOURNAL_EVENT_REPLICA_ALLOW 7
+#define JOURNAL_EVENT_REPLICA_REVOKE 8
+#define JOURNAL_EVENT_REPLICA_TIMEOUT 9
+
+/* The result field of records which are not about a script */
+#define JOURNAL_NO_RESULT INT32_MIN
+
+/* The header of segment and index files */
+typedef struct _journal_header_t {
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;
+} journal_header_t;
+
+/* One journal record. ip is an IPv4 address in network byte order.
+ * For script events result is the exit status of the script, or the
+ * negated signal number if it was killed. Records about replicated
+ * IPs (and their scripts) have a socket of -1 */
+typedef struct _journal_record_t {
+    int64_t timestamp;
+    uint32_t ip;
+    int32_t socket;
+    uint16_t type;
+    uint16_t reserved;
+    int32_t result;
+} journal_record_t;
+
+/* One entry of a segment index */
+typedef struct _journal_index_t {
+    uint32_t ip;
+    uint32_t record;
+} journal_index_t;
+
+int journal_init(const char *path);
+void journal_event(int type, const char *ip, int socket, int result);
+void journal_tick(time_t now);
+void journal_flush(void);
+void journal_close(void);
+
+#endif /* _AUTH_JOURNAL_H */
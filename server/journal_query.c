@@ -0,0 +1,408 @@
+/* Define this to get strptime() */
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <limits.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <arpa/inet.h>
+#include <time.h>
+
+#include "config.h"
+#include "journal.h"
+
+/* Names of the journal event types, indexed by JOURNAL_EVENT_* */
+static const char *event_names[] = {
+    "UNKNOWN",
+    "CONNECT",
+    "DISCONNECT",
+    "TIMEOUT",
+    "REVOKE",
+    "SCRIPT_ALLOW",
+    "SCRIPT_BLOCK",
+    "REPLICA_ALLOW",
+    "REPLICA_REVOKE",
+    "REPLICA_TIMEOUT",
+};
+
+/* The query parameters */
+static int64_t query_from = INT64_MIN;
+static int64_t query_to = INT64_MAX;
+static int query_by_ip = 0;
+static uint32_t query_ip;
+
+/*
+ * usage(name)
+ *
+ * Print the usage message
+ */
+static void
+usage(const char *name)
+{
+    fprintf(stderr,
+            "Usage: %s [-d dir] [-f from] [-t to] [-i ip]\n"
+            "\n"
+            "  -d dir   journal directory (default: %s)\n"
+            "  -f from  only show records at or after from\n"
+            "  -t to    only show records at or before to\n"
+            "  -i ip    only show records about ip\n"
+            "\n"
+            "Times are either Unix timestamps, or local times in the\n"
+            "\"YYYY-MM-DD\" or \"YYYY-MM-DD HH:MM:SS\" format.\n",
+            name, JOURNAL_DIR);
+}
+
+/*
+ * parse_time(str, result)
+ *
+ * Parse a time given on the command line. Returns 0 on success, -1 if
+ * str is not a valid time.
+ */
+static int
+parse_time(const char *str, int64_t *result)
+{
+    struct tm tm;
+    char *end;
+
+    // A plain number is a Unix timestamp
+    *result = strtoll(str, &end, 10);
+    if ((*end == 0) && (end != str)) {
+        return 0;
+    }
+
+    memset(&tm, 0, sizeof tm);
+    end = strptime(str, "%Y-%m-%d %H:%M:%S", &tm);
+    if ((end == NULL) || (*end != 0)) {
+        memset(&tm, 0, sizeof tm);
+        end = strptime(str, "%Y-%m-%d", &tm);
+        if ((end == NULL) || (*end != 0)) {
+            return -1;
+        }
+    }
+
+    tm.tm_isdst = -1;
+    *result = mktime(&tm);
+
+    return 0;
+}
+
+/*
+ * print_record(record)
+ *
+ * Print one journal record
+ */
+static void
+print_record(const journal_record_t *record)
+{
+    char date[100];
+    char ip[INET_ADDRSTRLEN];
+    time_t t = record->timestamp;
+    struct tm *tmp;
+    struct in_addr addr;
+
+    if ((tmp = localtime(&t)) == NULL) {
+        strcpy(date, "?");
+    } else {
+        strftime(date, sizeof date, "%Y-%m-%d %H:%M:%S", tmp);
+    }
+
+    addr.s_addr = record->ip;
+    inet_ntop(AF_INET, &addr, ip, sizeof ip);
+
+    printf("[%s] %s %s socket=%d",
+           date,
+           (record->type < sizeof event_names / sizeof event_names[0])
+               ? event_names[record->type]
+               : "UNKNOWN",
+           ip, record->socket);
+
+    if (record->result != JOURNAL_NO_RESULT) {
+        printf(" result=%d", record->result);
+    }
+
+    printf("\n");
+}
+
+/*
+ * map_file(dir_fd, name, magic, len)
+ *
+ * Memory-map a segment or index file, and check its header. Returns
+ * the mapping (with its length in len), or NULL if the file cannot be
+ * mapped or it is not a valid journal file.
+ */
+static void *
+map_file(int dir_fd, const char *name, const char *magic, size_t *len)
+{
+    struct stat st;
+    journal_header_t *header;
+    void *map;
+    int fd;
+
+    if ((fd = openat(dir_fd, name, O_RDONLY)) < 0) {
+        return NULL;
+    }
+
+    if ((fstat(fd, &st) < 0) || (st.st_size < sizeof(journal_header_t))) {
+        close(fd);
+
+        return NULL;
+    }
+
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (map == MAP_FAILED) {
+        return NULL;
+    }
+
+    header = map;
+    if ((strncmp(header->magic, magic, sizeof header->magic) != 0)
+        || (header->version != JOURNAL_VERSION)
+        || (header->record_size != sizeof(journal_record_t))) {
+        fprintf(stderr, "%s: not a valid journal file, skipping\n", name);
+        munmap(map, st.st_size);
+
+        return NULL;
+    }
+
+    *len = st.st_size;
+
+    return map;
+}
+
+/*
+ * query_by_index(records, count, index, index_count)
+ *
+ * Print the records of query_ip in the query's time range, using the
+ * segment's IP index
+ */
+static void
+query_by_index(const journal_record_t *records, size_t count,
+               const journal_index_t *index, size_t index_count)
+{
+    size_t low = 0;
+    size_t high = index_count;
+
+    // Find the first entry of query_ip
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+
+        if (index[mid].ip < query_ip) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+
+    // Entries of the same IP are ordered by record number, so they
+    // come in time order
+    for (; (low < index_count) && (index[low].ip == query_ip); low++) {
+        const journal_record_t *record;
+
+        if (index[low].record >= count) {
+            continue;
+        }
+
+        record = &records[index[low].record];
+
+        if (record->timestamp > query_to) {
+            break;
+        }
+
+        if (record->timestamp >= query_from) {
+            print_record(record);
+        }
+    }
+}
+
+/*
+ * query_by_time(records, count)
+ *
+ * Print the records in the query's time range (filtered by query_ip,
+ * if given), by binary searching the time ordered records
+ */
+static void
+query_by_time(const journal_record_t *records, size_t count)
+{
+    size_t low = 0;
+    size_t high = count;
+
+    // Find the first record at or after query_from
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+
+        if (records[mid].timestamp < query_from) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+
+    for (; (low < count) && (records[low].timestamp <= query_to); low++) {
+        if (query_by_ip && (records[low].ip != query_ip)) {
+            continue;
+        }
+
+        print_record(&records[low]);
+    }
+}
+
+/*
+ * query_segment(dir_fd, name)
+ *
+ * Run the query on one segment. The segment's index is used for IP
+ * queries if it exists; the segment being written by the server has
+ * no index yet, so it is searched by time.
+ */
+static void
+query_segment(int dir_fd, const char *name)
+{
+    const journal_record_t *records;
+    void *map;
+    size_t len;
+    size_t count;
+
+    if ((map = map_file(dir_fd, name, JOURNAL_SEGMENT_MAGIC, &len)) == NULL) {
+        return;
+    }
+
+    records = (const journal_record_t *)((char *)map + sizeof(journal_header_t));
+    count = (len - sizeof(journal_header_t)) / sizeof(journal_record_t);
+
+    // Skip the segment if all of its records are out of range
+    if ((count == 0)
+        || (records[count - 1].timestamp < query_from)
+        || (records[0].timestamp > query_to)) {
+        munmap(map, len);
+
+        return;
+    }
+
+    if (query_by_ip) {
+        char idx_name[PATH_MAX];
+        void *idx_map;
+        size_t idx_len;
+
+        snprintf(idx_name, sizeof idx_name, "%.*s.idx",
+                 (int)(strlen(name) - 4), name);
+
+        idx_map = map_file(dir_fd, idx_name, JOURNAL_INDEX_MAGIC, &idx_len);
+        if (idx_map != NULL) {
+            query_by_index(records, count,
+                           (const journal_index_t *)((char *)idx_map
+                                                     + sizeof(journal_header_t)),
+                           (idx_len - sizeof(journal_header_t))
+                               / sizeof(journal_index_t));
+            munmap(idx_map, idx_len);
+            munmap(map, len);
+
+            return;
+        }
+    }
+
+    query_by_time(records, count);
+    munmap(map, len);
+}
+
+/*
+ * segment_filter(entry)
+ *
+ * scandir() filter selecting the segment files
+ */
+static int
+segment_filter(const struct dirent *entry)
+{
+    size_t len = strlen(entry->d_name);
+
+    return (len > 4) && (strcmp(entry->d_name + len - 4, ".seg") == 0);
+}
+
+/*
+ * main()
+ *
+ * The main function of the journal query tool
+ */
+int
+main(int argc, char **argv)
+{
+    const char *dir = JOURNAL_DIR;
+    struct dirent **segments;
+    int dir_fd;
+    int count;
+    int opt;
+    int i;
+
+    while ((opt = getopt(argc, argv, "d:f:t:i:h")) != -1) {
+        switch (opt) {
+            case 'd':
+                dir = optarg;
+
+                break;
+            case 'f':
+                if (parse_time(optarg, &query_from) < 0) {
+                    fprintf(stderr, "Invalid time: %s\n", optarg);
+
+                    return 1;
+                }
+
+                break;
+            case 't':
+                if (parse_time(optarg, &query_to) < 0) {
+                    fprintf(stderr, "Invalid time: %s\n", optarg);
+
+                    return 1;
+                }
+
+                break;
+            case 'i':
+                if (inet_pton(AF_INET, optarg, &query_ip) != 1) {
+                    fprintf(stderr, "Invalid IP address: %s\n", optarg);
+
+                    return 1;
+                }
+                query_by_ip = 1;
+
+                break;
+            default:
+                usage(argv[0]);
+
+                return 1;
+        }
+    }
+
+    if ((dir_fd = open(dir, O_RDONLY | O_DIRECTORY)) < 0) {
+        perror(dir);
+
+        return 1;
+    }
+
+    // Segment names start with their first timestamp, so this sorts
+    // them by time
+    if ((count = scandir(dir, &segments, segment_filter, alphasort)) < 0) {
+        perror("scandir");
+
+        return 1;
+    }
+
+    for (i = 0; i < count; i++) {
+        // Segments starting after the end of the range (and all the
+        // following ones) can be skipped without opening them
+        if (strtoll(segments[i]->d_name, NULL, 10) <= query_to) {
+            query_segment(dir_fd, segments[i]->d_name);
+        }
+
+        free(segments[i]);
+    }
+
+    free(segments);
+    close(dir_fd);
+
+    return 0;
+}
@@ -0,0 +1,711 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/random.h>
+#include <netinet/in.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <time.h>
+
+#include "config.h"
+#include "server.h"
+#include "core.h"
+#include "replication.h"
+#include "firewall.h"
+#include "journal.h"
+
+/* Number of entries in one packet. This keeps packets well below the
+ * usual 1500 bytes MTU */
+#define REPLICATION_PACKET_ENTRIES 96
+
+/* Maximum number of packets read in one replication_handle() call, so
+ * a flood from the peers can't starve the clients */
+#define REPLICATION_MAX_READS 64
+
+/* The replication socket */
+static int repl_socket = -1;
+/* The peers' addresses */
+static struct sockaddr_storage repl_peers[REPLICATION_MAX_PEERS];
+static socklen_t repl_peer_lens[REPLICATION_MAX_PEERS];
+static int repl_peer_count = 0;
+/* Random identifier of this server, so it can ignore its own packets */
+static uint32_t repl_sender;
+/* Sequence number of the next packet */
+static uint32_t repl_seq = 0;
+/* Changes waiting to be sent */
+static replication_entry_t repl_pending[REPLICATION_PACKET_ENTRIES];
+static int repl_pending_len = 0;
+/* Time of the last anti-entropy sync */
+static time_t repl_last_sync = 0;
+/* The IPs allowed by the peers. Slots at or above repl_high are all
+ * unused, so lookups don't have to scan the whole table */
+static replica_t replicas[REPLICATION_MAX_REPLICAS];
+static int repl_high = 0;
+
+/*
+ * parse_address(str, addr, addrlen)
+ *
+ * Parse a host:port (or [ipv6]:port) string into a socket address.
+ * Returns 0 on success, -1 on failure.
+ */
+static int
+parse_address(const char *str, struct sockaddr_storage *addr,
+              socklen_t *addrlen)
+{
+    char host[256];
+    char *port;
+    struct addrinfo hints;
+    struct addrinfo *res;
+    int rv;
+
+    if (strlen(str) >= sizeof host) {
+        return -1;
+    }
+    strcpy(host, str);
+
+    // The port is after the last colon
+    if ((port = strrchr(host, ':')) == NULL) {
+        return -1;
+    }
+    *port++ = 0;
+
+    // Strip the brackets around IPv6 addresses
+    if ((host[0] == '[') && (port - host >= 3) && (port[-2] == ']')) {
+        port[-2] = 0;
+        memmove(host, host + 1, strlen(host));
+    }
+
+    memset(&hints, 0, sizeof hints);
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_DGRAM;
+
+    if ((rv = getaddrinfo(host, port, &hints, &res)) != 0) {
+        fprintf(stderr, "getaddrinfo: %s: %s\n", str, gai_strerror(rv));
+
+        return -1;
+    }
+
+    memcpy(addr, res->ai_addr, res->ai_addrlen);
+    *addrlen = res->ai_addrlen;
+    freeaddrinfo(res);
+
+    return 0;
+}
+
+/*
+ * same_address(a, b)
+ *
+ * Check if two socket addresses have the same address and port
+ */
+static int
+same_address(const struct sockaddr_storage *a, const struct sockaddr_storage *b)
+{
+    if (a->ss_family != b->ss_family) {
+        return 0;
+    }
+
+    if (a->ss_family == AF_INET) {
+        const struct sockaddr_in *a4 = (const struct sockaddr_in *)a;
+        const struct sockaddr_in *b4 = (const struct sockaddr_in *)b;
+
+        return (a4->sin_port == b4->sin_port)
+            && (a4->sin_addr.s_addr == b4->sin_addr.s_addr);
+    }
+
+    if (a->ss_family == AF_INET6) {
+        const struct sockaddr_in6 *a6 = (const struct sockaddr_in6 *)a;
+        const struct sockaddr_in6 *b6 = (const struct sockaddr_in6 *)b;
+
+        return (a6->sin6_port == b6->sin6_port)
+            && (memcmp(&a6->sin6_addr, &b6->sin6_addr,
+                       sizeof a6->sin6_addr) == 0);
+    }
+
+    return 0;
+}
+
+/*
+ * replication_init(bind_addr)
+ *
+ * Create the replication socket, bound to the host:port address
+ * bind_addr. Returns the socket, or -1 on failure.
+ */
+int
+replication_init(const char *bind_addr)
+{
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
+
+    if (parse_address(bind_addr, &addr, &addrlen) < 0) {
+        errno = EINVAL;
+
+        return -1;
+    }
+
+    if ((repl_socket = socket(addr.ss_family,
+                              SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                              0)) == -1) {
+        return -1;
+    }
+
+    if (bind(repl_socket, (struct sockaddr *)&addr, addrlen) == -1) {
+        close(repl_socket);
+        repl_socket = -1;
+
+        return -1;
+    }
+
+    // This only has to differ between the peers, but a pid and a
+    // start time can easily be the same on two hosts (e.g. in
+    // containers), so take it from the kernel's random pool
+    if (getrandom(&repl_sender, sizeof repl_sender, 0)
+        != sizeof repl_sender) {
+        close(repl_socket);
+        repl_socket = -1;
+
+        return -1;
+    }
+
+    return repl_socket;
+}
+
+/*
+ * replication_add_peer(peer_addr)
+ *
+ * Add a peer given as a host:port string. Packets are only accepted
+ * from the peers, so peer_addr must be the address the peer's
+ * replication socket is bound to. Returns 0 on success, -1 on
+ * failure.
+ */
+int
+replication_add_peer(const char *peer_addr)
+{
+    if (repl_peer_count == REPLICATION_MAX_PEERS) {
+        fprintf(stderr, "Too many replication peers\n");
+
+        return -1;
+    }
+
+    if (parse_address(peer_addr,
+                      &repl_peers[repl_peer_count],
+                      &repl_peer_lens[repl_peer_count]) < 0) {
+        return -1;
+    }
+
+    repl_peer_count++;
+
+    return 0;
+}
+
+/*
+ * local_client_exists(ip)
+ *
+ * Check if a client is connected to this server from ip
+ */
+static int
+local_client_exists(const char *ip)
+{
+    client_t *temp;
+
+    for (temp = client_list; temp; temp = temp->next) {
+        if (strcmp(temp->ip, ip) == 0) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * replica_find(sender, ip)
+ *
+ * Find the replica of the given IP (in network byte order) allowed by
+ * sender. Returns NULL if the sender doesn't replicate it.
+ */
+static replica_t *
+replica_find(uint32_t sender, uint32_t ip)
+{
+    int i;
+
+    for (i = 0; i < repl_high; i++) {
+        if (replicas[i].in_use && (replicas[i].ip == ip)
+            && (replicas[i].sender == sender)) {
+            return &replicas[i];
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * replica_drop(replica, type)
+ *
+ * Forget a replicated IP, and release its hold on the firewall. type
+ * is the journal event type of the reason
+ */
+static void
+replica_drop(replica_t *replica, int type)
+{
+    journal_event(type, replica->ip_str, -1, JOURNAL_NO_RESULT);
+
+    replica->in_use = 0;
+
+    // Shrink repl_high past the unused slots at the end
+    while ((repl_high > 0) && !replicas[repl_high - 1].in_use) {
+        repl_high--;
+    }
+
+    firewall_release(replica->ip_str, -1);
+}
+
+/*
+ * replica_drop_ip(ip, type)
+ *
+ * Forget the replicas of ip (in network byte order) of all the peers
+ */
+static void
+replica_drop_ip(uint32_t ip, int type)
+{
+    int i;
+
+    for (i = 0; i < repl_high; i++) {
+        if (replicas[i].in_use && (replicas[i].ip == ip)) {
+            replica_drop(&replicas[i], type);
+        }
+    }
+}
+
+/*
+ * replication_replicas(count)
+ *
+ * Return the replica table. Only the first count slots may be in use.
+ */
+replica_t *
+replication_replicas(int *count)
+{
+    *count = repl_high;
+
+    return replicas;
+}
+
+/*
+ * replication_send(type, entries, count)
+ *
+ * Send a packet with the given entries to all the peers. Failures are
+ * only logged, lost packets are repaired by the next sync.
+ */
+static void
+replication_send(int type, replication_entry_t *entries, int count)
+{
+    char packet[sizeof(replication_header_t)
+                + REPLICATION_PACKET_ENTRIES * sizeof(replication_entry_t)];
+    replication_header_t *header = (replication_header_t *)packet;
+    size_t len;
+    int i;
+
+    header->magic = htonl(REPLICATION_MAGIC);
+    header->sender = htonl(repl_sender);
+    header->seq = htonl(repl_seq++);
+    header->type = type;
+    header->reserved = 0;
+    header->count = htons(count);
+
+    len = sizeof(replication_header_t) + count * sizeof(replication_entry_t);
+    memcpy(packet + sizeof(replication_header_t), entries,
+           count * sizeof(replication_entry_t));
+
+    for (i = 0; i < repl_peer_count; i++) {
+        if (sendto(repl_socket, packet, len, MSG_DONTWAIT,
+                   (struct sockaddr *)&repl_peers[i],
+                   repl_peer_lens[i]) < 0) {
+            log_message(LOG_LEVEL_DEBUG,
+                        "replication sendto: %s", strerror(errno));
+        }
+    }
+}
+
+/*
+ * replication_fill_entry(entry, op, client, now)
+ *
+ * Fill a packet entry about a local client
+ */
+static void
+replication_fill_entry(replication_entry_t *entry, int op, client_t *client,
+                       time_t now)
+{
+    struct in_addr addr;
+    time_t ttl = 0;
+
+    if (inet_pton(AF_INET, client->ip, &addr) != 1) {
+        addr.s_addr = 0;
+    }
+
+    if (op == REPLICATION_OP_ALLOW) {
+        ttl = ((client->deadline > now) ? client->deadline - now : 0)
+            + REPLICATION_GRACE;
+    }
+
+    memset(entry, 0, sizeof *entry);
+    entry->ip = addr.s_addr;
+    entry->ttl = htonl(ttl);
+    entry->op = op;
+}
+
+/*
+ * replication_fill_deny(entry, ip, ttl)
+ *
+ * Fill a packet entry about a revoked IP
+ */
+static void
+replication_fill_deny(replication_entry_t *entry, uint32_t ip, time_t ttl)
+{
+    memset(entry, 0, sizeof *entry);
+    entry->ip = ip;
+    entry->ttl = htonl(ttl);
+    entry->op = REPLICATION_OP_DENY;
+}
+
+/*
+ * replication_pending_entry()
+ *
+ * Return the next free entry of the pending changes. If there is no
+ * room left, the pending changes are sent first.
+ */
+static replication_entry_t *
+replication_pending_entry(void)
+{
+    if (repl_pending_len == REPLICATION_PACKET_ENTRIES) {
+        replication_send(REPLICATION_PACKET_DELTA, repl_pending,
+                         repl_pending_len);
+        repl_pending_len = 0;
+    }
+
+    return &repl_pending[repl_pending_len++];
+}
+
+/*
+ * replication_event(op, client)
+ *
+ * Queue a change of a local client for the peers. A revoke is only
+ * sent when the last client of an IP disconnects.
+ */
+void
+replication_event(int op, client_t *client)
+{
+    if ((repl_socket < 0) || (repl_peer_count == 0)) {
+        return;
+    }
+
+    if ((op == REPLICATION_OP_REVOKE) && local_client_exists(client->ip)) {
+        return;
+    }
+
+    replication_fill_entry(replication_pending_entry(), op, client,
+                           time(NULL));
+}
+
+/*
+ * replication_deny(ip, seconds)
+ *
+ * Forget the replicas of a revoked IP, and tell the peers to refuse
+ * its clients for the given number of seconds
+ */
+void
+replication_deny(const char *ip, time_t seconds)
+{
+    struct in_addr addr;
+
+    if ((repl_socket < 0) || (inet_pton(AF_INET, ip, &addr) != 1)) {
+        return;
+    }
+
+    replica_drop_ip(addr.s_addr, JOURNAL_EVENT_REPLICA_REVOKE);
+
+    if (repl_peer_count > 0) {
+        replication_fill_deny(replication_pending_entry(), addr.s_addr,
+                              seconds);
+    }
+}
+
+/*
+ * replication_sync(now)
+ *
+ * Send the full list of the local clients, and of the revoked IPs, to
+ * the peers
+ */
+static void
+replication_sync(time_t now)
+{
+    replication_entry_t entries[REPLICATION_PACKET_ENTRIES];
+    client_t *temp;
+    denied_t *denials;
+    int denied_count;
+    int count = 0;
+    int i;
+
+    for (temp = client_list; temp; temp = temp->next) {
+        replication_fill_entry(&entries[count++], REPLICATION_OP_ALLOW,
+                               temp, now);
+
+        if (count == REPLICATION_PACKET_ENTRIES) {
+            replication_send(REPLICATION_PACKET_SYNC, entries, count);
+            count = 0;
+        }
+    }
+
+    denials = client_denials(&denied_count);
+    for (i = 0; i < denied_count; i++) {
+        struct in_addr addr;
+
+        if ((denials[i].until < now)
+            || (inet_pton(AF_INET, denials[i].ip, &addr) != 1)) {
+            continue;
+        }
+
+        replication_fill_deny(&entries[count++], addr.s_addr,
+                              denials[i].until - now);
+
+        if (count == REPLICATION_PACKET_ENTRIES) {
+            replication_send(REPLICATION_PACKET_SYNC, entries, count);
+            count = 0;
+        }
+    }
+
+    if (count > 0) {
+        replication_send(REPLICATION_PACKET_SYNC, entries, count);
+    }
+}
+
+/*
+ * replication_apply(sender, entry, now)
+ *
+ * Apply one entry received from a peer
+ */
+static void
+replication_apply(uint32_t sender, replication_entry_t *entry, time_t now)
+{
+    replica_t *replica;
+    char ip_str[CLIENT_IP_LEN];
+    int i;
+
+    inet_ntop(AF_INET, &entry->ip, ip_str, CLIENT_IP_LEN);
+
+    if (entry->op == REPLICATION_OP_DENY) {
+        // Revoked on a peer: refuse (and disconnect) the IP's clients
+        // here too, and forget it no matter which peer allowed it.
+        // Denials are repeated in every sync, only the first one is
+        // logged
+        if (!client_denied(ip_str)) {
+            log_message(LOG_LEVEL_INFO,
+                        "Replicated deny (IP: %s, peer: %08x)",
+                        ip_str, sender);
+            journal_event(JOURNAL_EVENT_REVOKE, ip_str, -1,
+                          JOURNAL_NO_RESULT);
+        }
+
+        client_revoke(ip_str, ntohl(entry->ttl));
+        replica_drop_ip(entry->ip, JOURNAL_EVENT_REPLICA_REVOKE);
+
+        return;
+    }
+
+    replica = replica_find(sender, entry->ip);
+
+    if (entry->op == REPLICATION_OP_REVOKE) {
+        if (replica) {
+            log_message(LOG_LEVEL_INFO,
+                        "Replicated revoke (IP: %s, peer: %08x)",
+                        replica->ip_str, sender);
+            replica_drop(replica, JOURNAL_EVENT_REPLICA_REVOKE);
+        }
+
+        return;
+    }
+
+    // Revoked IPs are not allowed again until their denial expires,
+    // even if a peer didn't hear about it yet
+    if ((entry->op != REPLICATION_OP_ALLOW) || client_denied(ip_str)) {
+        return;
+    }
+
+    if (replica) {
+        // Deadlines only move forward, so a reordered packet can't
+        // shorten them
+        if (replica->deadline < now + (time_t)ntohl(entry->ttl)) {
+            replica->deadline = now + ntohl(entry->ttl);
+        }
+
+        return;
+    }
+
+    // Find a free slot for the new replica
+    for (i = 0; i < REPLICATION_MAX_REPLICAS; i++) {
+        if (!replicas[i].in_use) {
+            break;
+        }
+    }
+
+    if (i == REPLICATION_MAX_REPLICAS) {
+        log_message(LOG_LEVEL_ERROR,
+                    "Replica table full (%d IPs), ignoring update",
+                    REPLICATION_MAX_REPLICAS);
+
+        return;
+    }
+
+    replica = &replicas[i];
+    replica->in_use = 1;
+    replica->sender = sender;
+    replica->ip = entry->ip;
+    replica->deadline = now + ntohl(entry->ttl);
+    strcpy(replica->ip_str, ip_str);
+
+    if (i >= repl_high) {
+        repl_high = i + 1;
+    }
+
+    log_message(LOG_LEVEL_INFO, "Replicated allow (IP: %s, peer: %08x)",
+                replica->ip_str, sender);
+    journal_event(JOURNAL_EVENT_REPLICA_ALLOW, replica->ip_str, -1,
+                  JOURNAL_NO_RESULT);
+
+    firewall_hold(replica->ip_str, -1);
+}
+
+/*
+ * replication_fd_set(read_fds)
+ *
+ * Add the replication socket to the descriptor set passed to
+ * select(). Returns the socket, or -1 if replication is disabled.
+ */
+int
+replication_fd_set(fd_set *read_fds)
+{
+    if (repl_socket >= 0) {
+        FD_SET(repl_socket, read_fds);
+    }
+
+    return repl_socket;
+}
+
+/*
+ * replication_handle(read_fds)
+ *
+ * Read and apply the packets of the peers. The replication socket is
+ * removed from read_fds, so the caller only sees its own sockets.
+ */
+void
+replication_handle(fd_set *read_fds)
+{
+    char packet[sizeof(replication_header_t)
+                + REPLICATION_PACKET_ENTRIES * sizeof(replication_entry_t)];
+    replication_header_t *header = (replication_header_t *)packet;
+    replication_entry_t *entries;
+    time_t now;
+    int reads;
+
+    if ((repl_socket < 0) || !FD_ISSET(repl_socket, read_fds)) {
+        return;
+    }
+
+    FD_CLR(repl_socket, read_fds);
+    now = time(NULL);
+
+    for (reads = 0; reads < REPLICATION_MAX_READS; reads++) {
+        struct sockaddr_storage from;
+        socklen_t fromlen = sizeof from;
+        ssize_t len;
+        int count;
+        int i;
+
+        len = recvfrom(repl_socket, packet, sizeof packet, 0,
+                       (struct sockaddr *)&from, &fromlen);
+
+        if (len < 0) {
+            if ((errno != EAGAIN) && (errno != EWOULDBLOCK)
+                && (errno != EINTR)) {
+                log_message(LOG_LEVEL_ERROR,
+                            "replication recvfrom: %s", strerror(errno));
+            }
+
+            return;
+        }
+
+        // Only accept packets from the configured peers
+        for (i = 0; i < repl_peer_count; i++) {
+            if (same_address(&from, &repl_peers[i])) {
+                break;
+            }
+        }
+
+        if (i == repl_peer_count) {
+            log_message(LOG_LEVEL_DEBUG,
+                        "Replication packet from unknown peer, dropping");
+
+            continue;
+        }
+
+        if ((len < (ssize_t)sizeof(replication_header_t))
+            || (ntohl(header->magic) != REPLICATION_MAGIC)
+            || (ntohl(header->sender) == repl_sender)) {
+            continue;
+        }
+
+        count = ntohs(header->count);
+        if ((count > REPLICATION_PACKET_ENTRIES)
+            || (len != (ssize_t)(sizeof(replication_header_t)
+                                 + count * sizeof(replication_entry_t)))) {
+            log_message(LOG_LEVEL_DEBUG,
+                        "Malformed replication packet, dropping");
+
+            continue;
+        }
+
+        entries = (replication_entry_t *)(packet + sizeof(replication_header_t));
+        for (i = 0; i < count; i++) {
+            replication_apply(ntohl(header->sender), &entries[i], now);
+        }
+    }
+}
+
+/*
+ * replication_tick(now)
+ *
+ * Send the queued changes, send the anti-entropy sync if it is due,
+ * and drop the replicas whose deadline has passed. Called from the
+ * main loop.
+ */
+void
+replication_tick(time_t now)
+{
+    int i;
+
+    if (repl_socket < 0) {
+        return;
+    }
+
+    if (repl_pending_len > 0) {
+        replication_send(REPLICATION_PACKET_DELTA, repl_pending,
+                         repl_pending_len);
+        repl_pending_len = 0;
+    }
+
+    if ((repl_peer_count > 0)
+        && (now - repl_last_sync >= REPLICATION_SYNC_INTERVAL)) {
+        replication_sync(now);
+        repl_last_sync = now;
+    }
+
+    for (i = 0; i < repl_high; i++) {
+        if (replicas[i].in_use && (now > replicas[i].deadline)) {
+            log_message(LOG_LEVEL_INFO,
+                        "Replica timeout (IP: %s, peer: %08x)",
+                        replicas[i].ip_str, replicas[i].sender);
+            replica_drop(&replicas[i], JOURNAL_EVENT_REPLICA_TIMEOUT);
+        }
+    }
+}
@@ -0,0 +1,70 @@
+#ifndef _AUTH_REPLICATION_H
+# define _AUTH_REPLICATION_H
+
+#include <stdint.h>
+#include <sys/select.h>
+
+#include "server.h"
+
+/* Replication keeps the firewall state of a group of knock servers in
+ * sync. Every server sends the changes of its own clients to its
+ * peers in UDP packets, batched once per main loop iteration, and the
+ * full list of its clients every REPLICATION_SYNC_INTERVAL seconds
+ * (anti-entropy, which also repairs lost packets). IPs allowed by the
+ * peers hold the firewall open (see firewall.h) until they are
+ * revoked, or not refreshed in time. An IP revoked through the control
+ * socket is refused by all the servers for REVOKE_DENY_TIME seconds. */
+
+#define REPLICATION_MAGIC 0x464b5231 /* "FKR1" */
+
+/* Packet types */
+#define REPLICATION_PACKET_DELTA 1
+#define REPLICATION_PACKET_SYNC 2
+
+/* Entry operations */
+#define REPLICATION_OP_ALLOW 1
+#define REPLICATION_OP_REVOKE 2
+#define REPLICATION_OP_DENY 3
+
+/* The packet header. All the fields are in network byte order */
+typedef struct _replication_header_t {
+    uint32_t magic;
+    uint32_t sender;
+    uint32_t seq;
+    uint8_t type;
+    uint8_t reserved;
+    uint16_t count;
+} replication_header_t;
+
+/* One entry of a packet. ttl is the number of seconds the IP stays
+ * allowed (or refused, for REPLICATION_OP_DENY), relative to the time
+ * the packet was sent, so the clocks of the peers don't need to be in
+ * sync */
+typedef struct _replication_entry_t {
+    uint32_t ip;
+    uint32_t ttl;
+    uint8_t op;
+    uint8_t reserved[3];
+} replication_entry_t;
+
+/* The replica_t struct. It holds an IP allowed by a peer. Every peer
+ * allowing the same IP has its own replica, so a revoke from one peer
+ * doesn't affect the others */
+typedef struct _replica_t {
+    int in_use;
+    uint32_t sender;
+    uint32_t ip;
+    char ip_str[CLIENT_IP_LEN];
+    time_t deadline;
+} replica_t;
+
+int replication_init(const char *bind_addr);
+int replication_add_peer(const char *peer_addr);
+int replication_fd_set(fd_set *read_fds);
+void replication_handle(fd_set *read_fds);
+void replication_tick(time_t now);
+void replication_event(int op, client_t *client);
+void replication_deny(const char *ip, time_t seconds);
+replica_t *replication_replicas(int *count);
+
+#endif /* _AUTH_REPLICATION_H */
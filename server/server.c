@@ -9,6 +9,7 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <netdb.h>
 #include <arpa/inet.h>
 #include <sys/wait.h>
@@ -19,13 +20,24 @@
 
 #include "config.h"
 #include "server.h"
+#include "core.h"
+#include "control.h"
+#include "journal.h"
+#include "replication.h"
+#include "firewall.h"
 
 /* FILE handle for the log file */
 FILE *log_fd;
-/* This will point to the beginning of the client list */
-client_t *client_list;
 /* This will hold all the available file descriptors */
 fd_set master;
+/* The sockets select() found readable in the current loop iteration */
+fd_set read_fds;
+/* The running connect and disconnect scripts */
+script_t scripts[MAX_RUNNING_SCRIPTS];
+/* Set by the SIGCHLD handler, cleared by reap_children() */
+volatile sig_atomic_t child_exited = 0;
+/* Set by the SIGTERM handler, checked by the main loop */
+volatile sig_atomic_t terminating = 0;
 
 /*
  * log_message(level, format, ...)
@@ -36,7 +48,7 @@ fd_set master;
  *
  * The log message should not end with a newline character.
  */
-static void
+void
 log_message(int level, const char *format, ...)
 {
     if (CURRENT_LOG_LEVEL >= level) {
@@ -80,42 +92,77 @@ log_message(int level, const char *format, ...)
  * sigchld_handler(signal)
  *
  * This is the signal handler for the SIGCHLD signal. It gets called
- * every time a child finishes its work (even with failure)
+ * every time a child finishes its work (even with failure). The dead
+ * children are collected by reap_children() in the main loop, as
+ * their exit status goes to the journal, which is not safe to do in a
+ * signal handler.
  */
 void
 sigchld_handler(int s)
 {
-    // Log a debug message about the finished child
-    log_message(LOG_LEVEL_DEBUG, "Found a hung child.");
-    // Clean up all the dead children (otherwise they turn into zombie
-    // processes)
-    while (waitpid(-1, NULL, WNOHANG) > 0);
+    child_exited = 1;
+}
+
+/*
+ * reap_children()
+ *
+ * Clean up all the dead children (otherwise they turn into zombie
+ * processes), and put the exit status of the connect and disconnect
+ * scripts in the journal
+ */
+void
+reap_children(void)
+{
+    pid_t pid;
+    int status;
+    int i;
+
+    if (!child_exited) {
+        return;
+    }
+    child_exited = 0;
+
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+        // Log a debug message about the finished child
+        log_message(LOG_LEVEL_DEBUG, "Found a hung child.");
+
+        for (i = 0; i < MAX_RUNNING_SCRIPTS; i++) {
+            if (scripts[i].pid == pid) {
+                journal_event(scripts[i].type, scripts[i].ip,
+                              scripts[i].socket,
+                              WIFEXITED(status)
+                                  ? WEXITSTATUS(status)
+                                  : -WTERMSIG(status));
+                scripts[i].pid = 0;
+
+                break;
+            }
+        }
+    }
 }
 
 /*
  * sigterm_handler(signal)
  *
  * This is the signal handler for the SIGTERM signal. It gets called
- * if someone kills the process with SIGTERM.
+ * if someone kills the process with SIGTERM. Logging and closing the
+ * journal are not safe to do in a signal handler, so the main loop
+ * shuts down the server when it sees the flag.
  */
 void
 sigterm_handler(int s)
 {
-    // Log this event as an information (it's not a real error, and
-    // shouldn't be a debug-only message)
-    log_message(LOG_LEVEL_INFO, "Got SIGTERM, shutting down.");
-    // TODO: clean shutdown! (Close client sockets, etc.)
-    // Exit after the shutdown.
-    exit(1);
+    terminating = 1;
 }
 
 /*
  * execute(command, parameter)
  *
- * Fork and execute the given program with exactly one parameter
+ * Fork and execute the given program with exactly one parameter.
+ * Returns the pid of the child, or -1 if fork() fails.
  */
-void
-execute(char *command, char *parameter)
+pid_t
+execute(const char *command, const char *parameter)
 {
     pid_t pid;
 
@@ -137,190 +184,159 @@ execute(char *command, char *parameter)
         fclose(log_fd);
         // TODO: Do a clean shutdown
         exit(1);
+    } else if (pid < 0) {
+        log_message(LOG_LEVEL_ERROR, "fork: %s", strerror(errno));
     }
+
+    return pid;
 }
 
 /*
- * client_new(socket, remote_addr)
+ * execute_script(command, type, ip, socket)
  *
- * Create a new client structure with the given data, and fully reset timer
+ * Execute a connect or disconnect script for the given IP, and
+ * remember it, so reap_children() can journal its exit status with
+ * the given journal event type and socket
  */
 void
-client_new(int socket, struct sockaddr_in *remote_addr)
+execute_script(const char *command, int type, const char *ip, int socket)
 {
-    client_t *client_data;
-    client_t *temp;
-    char *tmp_addr;
-
-    // Allocate memory for the new client's data
-    client_data = malloc(sizeof(client_t));
-    if (client_data == NULL) {
-        // Log an error message if allocation fails and exit with failure code
-        log_message(LOG_LEVEL_ERROR, "malloc: %s", strerror(errno));
-        exit(1);
-    }
+    pid_t pid;
+    int i;
 
-    // Allocate memory for the new client's IP address
-    tmp_addr = malloc(16);
-    if (tmp_addr == NULL) {
-        // Log an error message if allocation fails and exit with
-        // failure code. Here we also free the previously allocated
-        // client_data
-        log_message(LOG_LEVEL_ERROR, "malloc: %s", strerror(errno));
-        free(client_data);
-        exit(1);
+    if ((pid = execute(command, ip)) <= 0) {
+        return;
     }
 
-    // Zero-fill the address location, so the string will be surely
-    // nul-terminated
-    memset(tmp_addr, 0, 16);
-    // Get the numeric hostname (IP address) of the remote side
-    getnameinfo((const struct sockaddr *)remote_addr,
-                sizeof(struct sockaddr_in),
-                (char *)tmp_addr,
-                15, NULL, 0, NI_NUMERICHOST);
-
-    // Log the connection
-    log_message(LOG_LEVEL_INFO,
-                "New connection: %d (IP: %s)",
-                socket, tmp_addr);
-
-    // Fill the client_data struct
-    client_data->socket = socket;
-    client_data->ip = tmp_addr;
-    client_data->last_reset = time(NULL);
-    client_data->previous = NULL;
-    client_data->next = NULL;
-
-    // If the client list is empty (this is the first client)
-    if (!client_list) {
-        // The client_list should point to the newly allocated struct
-        client_list = client_data;
-    }
-    // Otherwise (this is not the first client
-    else {
-        // Set temp to the last element of the client list
-        for (temp = client_list; temp->next; temp = temp->next);
-        // Set the last element's next pointer to point to the newly
-        // allocated struct
-        temp->next = client_data;
-        // Set the newly allocated struct's previous pointer to the
-        // (till here) last client's struct
-        client_data->previous = temp;
+    // If all the slots are in use, the exit status is simply not
+    // journaled
+    for (i = 0; i < MAX_RUNNING_SCRIPTS; i++) {
+        if (scripts[i].pid == 0) {
+            scripts[i].pid = pid;
+            scripts[i].type = type;
+            scripts[i].socket = socket;
+            memset(scripts[i].ip, 0, CLIENT_IP_LEN);
+            strncpy(scripts[i].ip, ip, CLIENT_IP_LEN - 1);
+
+            break;
+        }
     }
-
-    // Execute the connect script
-    execute(CLIENT_CONNECT_SCRIPT, client_data->ip);
 }
 
 /*
- * client_remove(socket)
+ * server_now()
  *
- * Remove a client identified by its local socket number
+ * The core's clock: the real time
  */
-void
-client_remove(int socket)
+static time_t
+server_now(void)
 {
-    client_t *temp;
+    return time(NULL);
+}
 
-    // If we don't have an allocated client_list, we simply return, as
-    // we won't find the named client. However, this should never
-    // happen
-    if (!client_list) {
-        return;
+/*
+ * server_event(type, client)
+ *
+ * Pass the core's client events to the control socket subscribers,
+ * the journal and the replication peers
+ */
+static void
+server_event(int type, client_t *client)
+{
+    switch (type) {
+        case CORE_EVENT_CONNECT:
+            control_event(CONTROL_EVENT_CONNECT, client);
+            journal_event(JOURNAL_EVENT_CONNECT, client->ip, client->socket,
+                          JOURNAL_NO_RESULT);
+            // Tell the peers about the new client
+            replication_event(REPLICATION_OP_ALLOW, client);
+
+            break;
+        case CORE_EVENT_DISCONNECT:
+            control_event(CONTROL_EVENT_DISCONNECT, client);
+            journal_event(JOURNAL_EVENT_DISCONNECT, client->ip,
+                          client->socket, JOURNAL_NO_RESULT);
+            // Tell the peers about the lost client
+            replication_event(REPLICATION_OP_REVOKE, client);
+
+            break;
+        case CORE_EVENT_TIMEOUT:
+            control_event(CONTROL_EVENT_TIMEOUT, client);
+            journal_event(JOURNAL_EVENT_TIMEOUT, client->ip, client->socket,
+                          JOURNAL_NO_RESULT);
+
+            break;
     }
+}
 
-    // Walk through the client list
-    for (temp = client_list; temp; temp = temp->next) {
-        // If this element's socket number is the one we are looking for
-        if (temp->socket == socket) {
-            // Logging a message about the disconnection
-            log_message(LOG_LEVEL_INFO,
-                        "Connection lost: %d (IP: %s)",
-                        temp->socket, temp->ip);
-            // Remove this client from the linked list
-            if (temp->previous) {
-                temp->previous->next = temp->next;
-            }
-
-            if (temp->next) {
-                temp->next->previous = temp->previous;
-            }
-
-            // If this is the first client, set the client_list to
-            // point to the second item (or to NULL if this is also
-            // the last client)
-            if (temp == client_list) {
-                client_list = temp->next;
-            }
-
-            // If we don't have a previous, nor a next client in the
-            // list, then this was the last client, so client_list
-            // should be NULL This is only a paranoia check, this
-            // should already happen in the previous instruction
-            if ((!temp->previous) && (!temp->next)) {
-                client_list = NULL;
-            }
-
-            // Execute the disconnect script
-            execute(CLIENT_DISCONNECT_SCRIPT, temp->ip);
-
-            // Free the IP address' memory
-            free(temp->ip);
-            // Free the whols struct's memory
-            free(temp);
+/*
+ * server_allow(client)
+ *
+ * Hold the firewall open for a new client's IP. The connect script
+ * only runs if the IP was not allowed yet
+ */
+static void
+server_allow(client_t *client)
+{
+    firewall_hold(client->ip, client->socket);
+}
 
-            // Close the socket itself
-            close(socket);
-            // Remove this socket from the watched sockets' list
-            FD_CLR(socket, &master);
-        }
-    }
+/*
+ * server_block(client)
+ *
+ * Release a lost client's IP. The disconnect script only runs if no
+ * other client or peer holds it
+ */
+static void
+server_block(client_t *client)
+{
+    firewall_release(client->ip, client->socket);
 }
 
 /*
- * client_reset_timer(socket)
+ * server_close(socket)
  *
- * Reset a client's timer, identified by the local socket number
+ * Close a client's socket, and remove it from the watched sockets'
+ * list. It is also removed from read_fds: a client may be removed
+ * (e.g. revoked through the control socket) before its readiness is
+ * handled, and the socket number may be reused by accept() in the
+ * same loop iteration
  */
-void
-client_reset_timer(int socket)
+static void
+server_close(int socket)
 {
-    client_t *temp;
-
-    // Walk through the client list
-    for (temp = client_list; temp; temp = temp->next) {
-        // If the current client is the one we are looking for
-        if (temp->socket == socket) {
-            // Set its last reset time to the current timestamp
-            temp->last_reset = time(NULL);
-        }
-    }
+    close(socket);
+    FD_CLR(socket, &master);
+    FD_CLR(socket, &read_fds);
 }
 
+/* The core's connections to the real world */
+static const core_ops_t server_ops = {
+    server_now,
+    server_event,
+    server_allow,
+    server_block,
+    server_close,
+};
+
 /*
- * check_timers()
+ * usage(name)
  *
- * Check all clients if they have sent data in the near past, and
- * disconnect (thus, deauthenticate) them if not
+ * Print the usage message of the server
  */
 void
-check_timers(void)
+usage(const char *name)
 {
-    client_t *temp;
-
-    // Walk through the client list
-    for (temp = client_list; temp; temp = temp->next) {
-        // If this client hasn't sent data in DROP_AFTER seconds
-        if (time(NULL) - temp->last_reset > DROP_AFTER) {
-            // Log the timeout event
-            log_message(LOG_LEVEL_INFO,
-                        "Client timeout, dropping connection %d (IP: %s).",
-                        temp->socket, temp->ip);
-            // And remove the client from the client list
-            client_remove(temp->socket);
-        }
-    }
+    fprintf(stderr,
+            "Usage: %s [-f] [-p port] [-l logfile] [-c control socket]\n"
+            "       [-j journal dir] [-n max clients]\n"
+            "       [-R replication address] [-P peer address]...\n"
+            "\n"
+            "  -f  stay in the foreground\n"
+            "  -n  maximum number of clients (default: %d, at most %d)\n"
+            "  -R  enable replication, listening on host:port\n"
+            "  -P  replicate to (and accept updates from) host:port\n",
+            name, CLIENT_POOL_SIZE, FD_SETSIZE);
 }
 
 /*
@@ -329,20 +345,95 @@ check_timers(void)
  * The main function of the server program
  */
 int
-main(void)
+main(int argc, char **argv)
 {
+    const char *port = PORT;
+    const char *logfile = LOGFILE;
+    const char *control_socket = CONTROL_SOCKET;
+    const char *journal_dir = JOURNAL_DIR;
+    const char *replication_addr = NULL;
+    int max_clients = CLIENT_POOL_SIZE;
+    int foreground = 0;
+    int opt;
     int sock_listen;
     struct addrinfo hints;
     struct addrinfo *servinfo;
     struct addrinfo *p;
     int yes = 1;
+    int sockopt_value;
     int rv;
-    fd_set read_fds;
+    fd_set write_fds;
     int fdmax;
     struct sigaction sa;
 
-    // Initially set the client list to empty
-    client_list = NULL;
+    // Parse the command line. The options override the defaults in
+    // config.h, which allows running several instances on one host
+    while ((opt = getopt(argc, argv, "fp:l:c:j:n:R:P:h")) != -1) {
+        switch (opt) {
+            case 'f':
+                foreground = 1;
+
+                break;
+            case 'p':
+                port = optarg;
+
+                break;
+            case 'l':
+                logfile = optarg;
+
+                break;
+            case 'c':
+                control_socket = optarg;
+
+                break;
+            case 'j':
+                journal_dir = optarg;
+
+                break;
+            case 'n':
+                max_clients = atoi(optarg);
+                if (max_clients < 1) {
+                    usage(argv[0]);
+
+                    return 1;
+                }
+
+                break;
+            case 'R':
+                replication_addr = optarg;
+
+                break;
+            case 'P':
+                if (replication_add_peer(optarg) < 0) {
+                    return 1;
+                }
+
+                break;
+            default:
+                usage(argv[0]);
+
+                return 1;
+        }
+    }
+
+    // Client sockets are watched with select(), so there can't be
+    // more clients than FD_SETSIZE
+    if (max_clients > FD_SETSIZE) {
+        fprintf(stderr, "Limiting the number of clients to %d\n",
+                FD_SETSIZE);
+        max_clients = FD_SETSIZE;
+    }
+
+    // Set up the client state machine, preallocating the client
+    // records, and the firewall table. Every allowed IP is held by a
+    // client or a replica, so the table never needs more entries
+    // than these together
+    if ((core_init(&server_ops, max_clients, FD_SETSIZE) < 0)
+        || (firewall_init(max_clients + REPLICATION_MAX_REPLICAS) < 0)) {
+        perror("calloc");
+
+        return 1;
+    }
 
     // Set the SIGCHLD handler (which will purge zombie children)
     sa.sa_handler = sigchld_handler;
@@ -371,7 +462,7 @@ main(void)
     hints.ai_flags = AI_PASSIVE;	// use my IP
 
     // Check if our port number is already in use
-    if ((rv = getaddrinfo (NULL, PORT, &hints, &servinfo)) != 0) {
+    if ((rv = getaddrinfo (NULL, port, &hints, &servinfo)) != 0) {
         fprintf(stderr, "getaddrinfo: %s", gai_strerror(rv));
 
         return 1;
@@ -410,6 +501,28 @@ main(void)
 
     freeaddrinfo(servinfo);
 
+#ifdef USE_TCP_FASTOPEN
+    // Accept data in the SYN packet, so the first heartbeat of a
+    // returning client doesn't have to wait for the handshake. This
+    // is not fatal, we simply work without it
+    sockopt_value = TCP_FASTOPEN_QUEUE;
+    if (setsockopt(sock_listen, IPPROTO_TCP, TCP_FASTOPEN,
+                   &sockopt_value, sizeof(int)) == -1) {
+        perror("setsockopt(TCP_FASTOPEN)");
+    }
+#endif
+
+#ifdef DEFER_ACCEPT_TIMEOUT
+    // Only wake up for connections which already sent data. Clients
+    // send their first heartbeat right after connecting, so idle
+    // connections (e.g. floods) never reach accept()
+    sockopt_value = DEFER_ACCEPT_TIMEOUT;
+    if (setsockopt(sock_listen, IPPROTO_TCP, TCP_DEFER_ACCEPT,
+                   &sockopt_value, sizeof(int)) == -1) {
+        perror("setsockopt(TCP_DEFER_ACCEPT)");
+    }
+#endif
+
     // Start listening on the listener socket
     if (listen(sock_listen, BACKLOG) == -1) {
         perror("listen");
@@ -425,15 +538,39 @@ main(void)
     FD_SET(sock_listen, &master);
     fdmax = sock_listen;
 
+    // Open the local control socket. This must happen before
+    // daemon(), as the control socket may be a relative path
+    if (control_init(control_socket) < 0) {
+        perror("control socket");
+
+        exit(1);
+    }
+
+    // Open the journal. Like the control socket, this must happen
+    // before daemon()
+    if (journal_init(journal_dir) < 0) {
+        perror("journal");
+
+        exit(1);
+    }
+
+    // Open the replication socket, if replication is enabled
+    if (replication_addr
+        && (replication_init(replication_addr) < 0)) {
+        perror("replication socket");
+
+        exit(1);
+    }
+
     // Try to open (or create) the log file
-    if ((log_fd = fopen(LOGFILE, "a")) == NULL) {
+    if ((log_fd = fopen(logfile, "a")) == NULL) {
         perror("fopen");
 
         exit(1);
     }
 
     // Try to go into the background
-    if (daemon(0, 0) < 0) {
+    if (!foreground && (daemon(0, 0) < 0)) {
         perror("daemon");
 
         exit(1);
@@ -444,9 +581,34 @@ main(void)
     while (1) {
         struct timeval tv;
         int t;
+        int control_max;
+        int replication_fd;
+
+        // If we got a SIGTERM, shut down. select() is interrupted by
+        // the signal, so this happens right away
+        if (terminating) {
+            // Log this event as an information (it's not a real
+            // error, and shouldn't be a debug-only message)
+            log_message(LOG_LEVEL_INFO, "Got SIGTERM, shutting down.");
+            // Write out the buffered journal records
+            journal_close();
+            // TODO: clean shutdown! (Close client sockets, etc.)
+            // Exit after the shutdown.
+            exit(1);
+        }
 
         // Reset the read_fds with the full list of watched sockets
         read_fds = master;
+        FD_ZERO(&write_fds);
+
+        // Add the control socket and its connections. These are
+        // never put in master, so the client handling below won't
+        // see them
+        control_max = control_fd_set(&read_fds, &write_fds);
+        replication_fd = replication_fd_set(&read_fds);
+        if (replication_fd > control_max) {
+            control_max = replication_fd;
+        }
 
         // Set the timeout value
         tv.tv_sec = 1;
@@ -455,7 +617,8 @@ main(void)
         // Wait for incoming connection or incoming data. "Modified"
         // sockets (ones with incoming connections or incoming data)
         // will be put in read_fds
-        t = select(fdmax + 1, &read_fds, NULL, NULL, &tv);
+        t = select(((control_max > fdmax) ? control_max : fdmax) + 1,
+                   &read_fds, &write_fds, NULL, &tv);
 
         // If select() returns a negative, it means an error
         if (t < 0) {
@@ -476,6 +639,12 @@ main(void)
         else if (t != 0) {
             int sock;
 
+            // Serve the control connections first. This removes the
+            // control sockets from read_fds
+            control_handle(&read_fds, &write_fds);
+            // The same goes for the replication socket
+            replication_handle(&read_fds);
+
             // Walk through the watched sockets (the lazy way, later
             // this can cause some microseconds of hang up, as not all
             // sockets are really monitored in this set [0..fdmax])
@@ -486,6 +655,7 @@ main(void)
                     // If the socket we found is the listener
                     if (sock == sock_listen) {
                         int new_socket;
+                        char ip[CLIENT_IP_LEN];
                         struct sockaddr_in remote_addr;
                         socklen_t addrlen = sizeof(struct sockaddr_in);
 
@@ -494,14 +664,38 @@ main(void)
                                             (struct sockaddr *)&remote_addr,
                                             &addrlen);
 
+                        if (new_socket < 0) {
+                            log_message(LOG_LEVEL_ERROR,
+                                        "accept: %s",
+                                        strerror(errno));
+
+                            continue;
+                        }
+
+                        // Zero-fill the address location, so the
+                        // string will be surely nul-terminated
+                        memset(ip, 0, CLIENT_IP_LEN);
+                        // Get the numeric hostname (IP address) of
+                        // the remote side
+                        getnameinfo((const struct sockaddr *)&remote_addr,
+                                    sizeof(struct sockaddr_in),
+                                    ip, CLIENT_IP_LEN - 1,
+                                    NULL, 0, NI_NUMERICHOST);
+
+                        // Create a new client entry for the new
+                        // connection. If there is no room for it,
+                        // drop the connection
+                        if (client_new(new_socket, ip) < 0) {
+                            close(new_socket);
+
+                            continue;
+                        }
+
                         // Add the new connection to the watched sockets
                         FD_SET(new_socket, &master);
                         if (new_socket > fdmax) {
                             fdmax = new_socket;
                         }
-
-                        // Create a new client entry for the new connection
-                        client_new(new_socket, &remote_addr);
                     } else {
                         // Otherwise it's an already existing socket
                         // which has data to read
@@ -547,6 +741,15 @@ main(void)
         // to check (select() returned 0), we go and check if any
         // clients timed out
         check_timers();
+
+        // Journal the exit status of the finished scripts, and write
+        // out the journal if it waits for too long
+        reap_children();
+        journal_tick(time(NULL));
+
+        // Send the batched changes to the replication peers, and
+        // expire the IPs they don't refresh
+        replication_tick(time(NULL));
     }
 
     fclose(log_fd);
@@ -1,19 +1,45 @@
 #ifndef _AUTH_SERVER_H
 # define _AUTH_SERVER_H
 
+#include <time.h>
+#include <sys/types.h>
+#include <sys/select.h>
+
 /* Logging levels. These are the possible values for CURRENT_LOG_LEVEL above */
 #define LOG_LEVEL_ERROR 0
 #define LOG_LEVEL_INFO 1
 #define LOG_LEVEL_DEBUG 2
 
+/* Size of the inline IP address buffer in client_t. This is enough
+ * to hold a dotted-quad IPv4 address with the terminating nul */
+#define CLIENT_IP_LEN 16
+
 /* The client_t struct. With this struct full client data can be
- * stored in a doubly-linked list */
+ * stored in a doubly-linked list. The structs themselves live in a
+ * preallocated slab (see client_pool_init() in core.c), unused slots are
+ * chained together through the next pointer */
 typedef struct _client_t {
     int socket;
-    char *ip;
+    char ip[CLIENT_IP_LEN];
     time_t last_reset;
+    time_t deadline;
     struct _client_t *previous;
     struct _client_t *next;
 } client_t;
 
+/* The script_t struct. It remembers which client a running connect
+ * or disconnect script belongs to, so its exit status can be put in
+ * the journal. A pid of 0 marks an unused slot */
+typedef struct _script_t {
+    pid_t pid;
+    int type;
+    int socket;
+    char ip[CLIENT_IP_LEN];
+} script_t;
+
+void log_message(int level, const char *format, ...);
+pid_t execute(const char *command, const char *parameter);
+void execute_script(const char *command, int type, const char *ip,
+                    int socket);
+
 #endif /* _AUTH_SERVER_H */
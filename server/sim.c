@@ -0,0 +1,470 @@
+/*
+ * Deterministic simulator of the server core.
+ *
+ * It drives the client state machine in core.c with synthetic
+ * connect, heartbeat and drop events in virtual time, without any
+ * sockets, scripts or real seconds. A shadow model of every client is
+ * kept next to the core, and each timeout is checked against it: no
+ * client may be dropped before DROP_AFTER seconds of silence, and none
+ * may stay after that. The same seed always gives the same run.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <time.h>
+
+#include "config.h"
+#include "server.h"
+#include "core.h"
+
+/* The shadow_t struct. It holds what the simulator expects about one
+ * socket */
+typedef struct _shadow_t {
+    int connected;
+    int silent;
+    time_t last;
+    int position;
+} shadow_t;
+
+/* The virtual clock */
+static time_t sim_time = 1000000000;
+/* The shadow model, indexed by socket number. The arrays are as long
+ * as the maximum number of clients */
+static shadow_t *shadow;
+/* The connected sockets, so a random one can be picked in O(1) */
+static int *connected;
+static int connected_count = 0;
+/* The free sockets */
+static int *free_sockets;
+static int free_count = 0;
+
+/* Statistics */
+static unsigned long long stat_connects = 0;
+static unsigned long long stat_heartbeats = 0;
+static unsigned long long stat_drops = 0;
+static unsigned long long stat_timeouts = 0;
+static unsigned long long stat_allows = 0;
+static unsigned long long stat_blocks = 0;
+static unsigned long long stat_errors = 0;
+/* Nanoseconds spent in the core, and the number of calls into it */
+static unsigned long long core_ns = 0;
+static unsigned long long core_calls = 0;
+/* Nanoseconds taken by timing an empty call, measured at startup. A
+ * core call takes only tens of nanoseconds, so this is subtracted
+ * from every measurement */
+static unsigned long long timer_ns = 0;
+
+/*
+ * log_message(level, format, ...)
+ *
+ * The core logs through this. The simulator is silent, so the
+ * messages are dropped.
+ */
+void
+log_message(int level, const char *format, ...)
+{
+}
+
+/*
+ * sim_error(message, socket)
+ *
+ * Report a correctness error
+ */
+static void
+sim_error(const char *message, int socket)
+{
+    stat_errors++;
+
+    // Don't flood the terminal if something is badly broken
+    if (stat_errors <= 10) {
+        fprintf(stderr, "t=%ld socket %d: %s\n",
+                (long)sim_time, socket, message);
+    }
+}
+
+/*
+ * nsec()
+ *
+ * Return the monotonic clock in nanoseconds. The simulator never
+ * blocks, so this is its CPU time too (unless the CPU is shared), and
+ * reading it is far cheaper than CLOCK_PROCESS_CPUTIME_ID
+ */
+static unsigned long long
+nsec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (unsigned long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * cpu_nsec()
+ *
+ * Return the CPU time of the process in nanoseconds
+ */
+static unsigned long long
+cpu_nsec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+
+    return (unsigned long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * timer_calibrate()
+ *
+ * Measure the overhead of timing a call, the same way the core calls
+ * are timed, but with nothing in between
+ */
+static void
+timer_calibrate(void)
+{
+    unsigned long long start;
+    unsigned long long total = 0;
+    int i;
+
+    for (i = 0; i < 1000000; i++) {
+        start = nsec();
+        total += nsec() - start;
+    }
+
+    timer_ns = total / 1000000;
+}
+
+/*
+ * sim_now()
+ *
+ * The core's clock: virtual time
+ */
+static time_t
+sim_now(void)
+{
+    return sim_time;
+}
+
+/*
+ * sim_event(type, client)
+ *
+ * Check the timeouts against the shadow model
+ */
+static void
+sim_event(int type, client_t *client)
+{
+    shadow_t *s = &shadow[client->socket];
+
+    if (!s->connected) {
+        sim_error("event about a client which is not connected",
+                  client->socket);
+
+        return;
+    }
+
+    if (type == CORE_EVENT_TIMEOUT) {
+        stat_timeouts++;
+
+        if (sim_time <= s->last + DROP_AFTER) {
+            sim_error("dropped too early", client->socket);
+        }
+    }
+}
+
+/*
+ * sim_allow(client)
+ *
+ * Count the firewall allow actions
+ */
+static void
+sim_allow(client_t *client)
+{
+    stat_allows++;
+}
+
+/*
+ * sim_block(client)
+ *
+ * Count the firewall block actions
+ */
+static void
+sim_block(client_t *client)
+{
+    stat_blocks++;
+}
+
+/*
+ * sim_close(socket)
+ *
+ * Update the shadow model when the core closes a socket
+ */
+static void
+sim_close(int socket)
+{
+    shadow_t *s = &shadow[socket];
+    int last;
+
+    if (!s->connected) {
+        sim_error("closed twice", socket);
+
+        return;
+    }
+
+    // Remove the socket from the connected array by moving the last
+    // one into its place
+    last = connected[--connected_count];
+    connected[s->position] = last;
+    shadow[last].position = s->position;
+
+    s->connected = 0;
+    free_sockets[free_count++] = socket;
+}
+
+/* The core's connections to the simulated world */
+static const core_ops_t sim_ops = {
+    sim_now,
+    sim_event,
+    sim_allow,
+    sim_block,
+    sim_close,
+};
+
+/*
+ * sim_check()
+ *
+ * Check that no client outlived its deadline
+ */
+static void
+sim_check(void)
+{
+    int i;
+
+    for (i = 0; i < connected_count; i++) {
+        if (sim_time > shadow[connected[i]].last + DROP_AFTER) {
+            sim_error("not dropped after its deadline", connected[i]);
+        }
+    }
+}
+
+/*
+ * sim_tick()
+ *
+ * Advance the virtual clock by one second, and run the timer check
+ * like the server's main loop does
+ */
+static void
+sim_tick(void)
+{
+    unsigned long long start;
+
+    sim_time++;
+
+    start = nsec();
+    check_timers();
+    core_ns += nsec() - start;
+    core_calls++;
+
+    sim_check();
+}
+
+/*
+ * usage(name)
+ *
+ * Print the usage message
+ */
+static void
+usage(const char *name)
+{
+    fprintf(stderr,
+            "Usage: %s [-n events] [-c clients] [-r rate] [-q silent%%]"
+            " [-s seed]\n"
+            "\n"
+            "  -n  number of events to simulate (default: 10000000)\n"
+            "  -c  maximum number of clients (default: %d)\n"
+            "  -r  events per virtual second (default: 1000)\n"
+            "  -q  percentage of clients never sending heartbeats"
+            " (default: 5)\n"
+            "  -s  random seed (default: 1)\n",
+            name, CLIENT_POOL_SIZE);
+}
+
+/*
+ * main()
+ *
+ * The main function of the simulator
+ */
+int
+main(int argc, char **argv)
+{
+    unsigned long long events = 10000000;
+    unsigned long long n;
+    int clients = CLIENT_POOL_SIZE;
+    int rate = 1000;
+    int silent_pct = 5;
+    unsigned int seed = 1;
+    unsigned long long cpu;
+    unsigned long long net_ns;
+    int opt;
+    int i;
+
+    while ((opt = getopt(argc, argv, "n:c:r:q:s:h")) != -1) {
+        switch (opt) {
+            case 'n':
+                events = strtoull(optarg, NULL, 10);
+
+                break;
+            case 'c':
+                clients = atoi(optarg);
+
+                break;
+            case 'r':
+                rate = atoi(optarg);
+
+                break;
+            case 'q':
+                silent_pct = atoi(optarg);
+
+                break;
+            case 's':
+                seed = strtoul(optarg, NULL, 10);
+
+                break;
+            default:
+                usage(argv[0]);
+
+                return 1;
+        }
+    }
+
+    if ((clients < 1) || (rate < 1)) {
+        usage(argv[0]);
+
+        return 1;
+    }
+
+    srandom(seed);
+
+    // The core's client pool is as large as the simulated population,
+    // and the socket numbers are below it too
+    shadow = calloc(clients, sizeof(shadow_t));
+    connected = calloc(clients, sizeof(int));
+    free_sockets = calloc(clients, sizeof(int));
+
+    if ((shadow == NULL) || (connected == NULL) || (free_sockets == NULL)
+        || (core_init(&sim_ops, clients, clients) < 0)) {
+        perror("calloc");
+
+        return 1;
+    }
+
+    for (i = clients - 1; i >= 0; i--) {
+        free_sockets[free_count++] = i;
+    }
+
+    timer_calibrate();
+
+    cpu = cpu_nsec();
+
+    for (n = 0; n < events; n++) {
+        unsigned long long start;
+        long r = random() % 100;
+        int socket;
+
+        if ((free_count > 0) && ((r < 20) || (connected_count == 0))) {
+            // Connect a new client
+            char ip[CLIENT_IP_LEN];
+            shadow_t *s;
+
+            socket = free_sockets[--free_count];
+            snprintf(ip, sizeof ip, "10.%d.%d.%d",
+                     (socket >> 16) & 0xff, (socket >> 8) & 0xff,
+                     socket & 0xff);
+
+            s = &shadow[socket];
+            s->connected = 1;
+            s->silent = (random() % 100) < silent_pct;
+            s->last = sim_time;
+            s->position = connected_count;
+            connected[connected_count++] = socket;
+
+            start = nsec();
+            if (client_new(socket, ip) < 0) {
+                sim_error("client_new failed", socket);
+            }
+            core_ns += nsec() - start;
+            core_calls++;
+
+            stat_connects++;
+        } else if (r < 95) {
+            // A random client sends a heartbeat, unless it's silent
+            socket = connected[random() % connected_count];
+
+            if (!shadow[socket].silent) {
+                shadow[socket].last = sim_time;
+
+                start = nsec();
+                client_reset_timer(socket);
+                core_ns += nsec() - start;
+                core_calls++;
+
+                stat_heartbeats++;
+            }
+        } else {
+            // A random client closes its connection
+            socket = connected[random() % connected_count];
+
+            start = nsec();
+            client_remove(socket);
+            core_ns += nsec() - start;
+            core_calls++;
+
+            if (shadow[socket].connected) {
+                sim_error("not removed", socket);
+            }
+
+            stat_drops++;
+        }
+
+        if ((n + 1) % rate == 0) {
+            sim_tick();
+        }
+    }
+
+    // Let every remaining client time out
+    for (i = 0; i <= DROP_AFTER + 1; i++) {
+        sim_tick();
+    }
+
+    cpu = cpu_nsec() - cpu;
+
+    // Take the timer's own overhead out of the core's time
+    net_ns = (core_ns > timer_ns * core_calls)
+        ? core_ns - timer_ns * core_calls : 0;
+
+    if ((connected_count != 0) || (client_list != NULL)) {
+        sim_error("clients left after the final timeout", -1);
+    }
+
+    if (stat_allows != stat_blocks) {
+        sim_error("allow and block actions don't match", -1);
+    }
+
+    printf("events:          %llu (%ld virtual seconds)\n",
+           events, (long)(sim_time - 1000000000));
+    printf("connects:        %llu\n", stat_connects);
+    printf("heartbeats:      %llu\n", stat_heartbeats);
+    printf("drops:           %llu\n", stat_drops);
+    printf("timeouts:        %llu\n", stat_timeouts);
+    printf("allows/blocks:   %llu/%llu\n", stat_allows, stat_blocks);
+    printf("core calls:      %llu\n", core_calls);
+    printf("core time:       %.3f s (%.1f ns/call, %llu ns/call"
+           " timer overhead subtracted)\n",
+           net_ns / 1e9, core_calls ? (double)net_ns / core_calls : 0.0,
+           timer_ns);
+    printf("total CPU time:  %.3f s\n", cpu / 1e9);
+    printf("errors:          %llu\n", stat_errors);
+
+    return stat_errors ? 1 : 0;
+}